@@ -0,0 +1,496 @@
+#include "sq_vm.h"
+#include "sq_blob.h"
+#include "sq_json.h"
+
+#include <benchmark/benchmark.h>
+#include <sqstdaux.h>
+#include <sqstdblob.h>
+#include <sqstdio.h>
+#include <sqstdmath.h>
+#include <sqstdstring.h>
+#include <sqstdsystem.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Each wrapper benchmark has a BM_Raw* baseline doing the same work with the
+// plain Squirrel API, the difference is the wrapper overhead per operation.
+
+namespace {
+
+const char* const ADD_SCRIPT = "function add(a, b) { return a + b; }";
+
+// Root table slot value, referenced
+HSQOBJECT getRootSlot(HSQUIRRELVM v, const SQChar* name) {
+  HSQOBJECT result;
+  sq_pushroottable(v);
+  sq_pushstring(v, name, -1);
+  sq_get(v, -2);
+  sq_getstackobj(v, -1, &result);
+  sq_addref(v, &result);
+  sq_pop(v, 2);
+  return result;
+}
+
+void pushTable(HSQUIRRELVM v, SQInteger size) {
+  sq_newtableex(v, size);
+  for (SQInteger i = 0; i < size; ++i) {
+    sq_pushinteger(v, i);
+    const std::string value = "value" + std::to_string(i);
+    sq_pushstring(v, value.c_str(), value.size());
+    sq_newslot(v, -3, SQFalse);
+  }
+}
+
+SQInteger rawAdd(HSQUIRRELVM v) {
+  SQInteger a, b;
+  sq_getinteger(v, 2, &a);
+  sq_getinteger(v, 3, &b);
+  sq_pushinteger(v, a + b);
+  return 1;
+}
+
+}
+
+// Stack guard overhead
+
+static void BM_RawPushPop(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  for (auto _: state) {
+    sq_pushinteger(v, 1);
+    sq_pop(v, 1);
+  }
+}
+BENCHMARK(BM_RawPushPop);
+
+template <typename Policy>
+static void BM_GuardedPushPop(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  for (auto _: state) {
+    {
+      sq::VM::BasicTopGuard<Policy> g(&vm, true, __FILE__, __LINE__, __FUNCTION__);
+      sq_pushinteger(v, 1);
+      g.check(1);
+    }
+    {
+      sq::VM::BasicTopGuard<Policy> g(&vm, true, __FILE__, __LINE__, __FUNCTION__);
+      sq_pop(v, 1);
+      g.check(-1);
+    }
+  }
+}
+BENCHMARK_TEMPLATE(BM_GuardedPushPop, sq::VM::CheckedStack);
+BENCHMARK_TEMPLATE(BM_GuardedPushPop, sq::VM::UncheckedStack);
+
+static void BM_VMPushPop(benchmark::State& state) {
+  sq::VM vm;
+  for (auto _: state) {
+    vm << SQInteger(1);
+    vm.pop();
+  }
+}
+BENCHMARK(BM_VMPushPop);
+
+// Push and read back
+
+static void BM_RawPushGet(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  for (auto _: state) {
+    SQInteger value;
+    sq_pushinteger(v, 1);
+    sq_getinteger(v, -1, &value);
+    sq_pop(v, 1);
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_RawPushGet);
+
+static void BM_VMPushGet(benchmark::State& state) {
+  sq::VM vm;
+  for (auto _: state) {
+    SQInteger value;
+    vm << SQInteger(1);
+    vm >> value;
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_VMPushGet);
+
+static void BM_RawPushGetString(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  const std::string data(state.range(0), 'x');
+  for (auto _: state) {
+    const SQChar* str;
+    SQInteger size;
+    sq_pushstring(v, data.c_str(), data.size());
+    sq_getstringandsize(v, -1, &str, &size);
+    std::string value(str, size);
+    sq_pop(v, 1);
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_RawPushGetString)->Arg(8)->Arg(1024);
+
+static void BM_VMPushGetString(benchmark::State& state) {
+  sq::VM vm;
+  const std::string data(state.range(0), 'x');
+  for (auto _: state) {
+    std::string value;
+    vm << data;
+    vm >> value;
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_VMPushGetString)->Arg(8)->Arg(1024);
+
+// Fields
+
+static void BM_RawGetField(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  sq_newtable(v);
+  sq_pushstring(v, "field", -1);
+  sq_pushinteger(v, 42);
+  sq_newslot(v, -3, SQFalse);
+  for (auto _: state) {
+    SQInteger value;
+    sq_pushstring(v, "field", -1);
+    sq_get(v, -2);
+    sq_getinteger(v, -1, &value);
+    sq_pop(v, 1);
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_RawGetField);
+
+static void BM_VMGetIntField(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushNewTable();
+  vm.makeSlot("field", SQInteger(42));
+  for (auto _: state)
+    benchmark::DoNotOptimize(vm.getIntField("field"));
+}
+BENCHMARK(BM_VMGetIntField);
+
+static void BM_VMGetIntFieldHandle(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushNewTable();
+  vm.makeSlot("field", SQInteger(42));
+  const sq::VM::FieldHandle field = vm.getFieldHandle("field");
+  for (auto _: state)
+    benchmark::DoNotOptimize(vm.getIntField(field));
+}
+BENCHMARK(BM_VMGetIntFieldHandle);
+
+static void BM_VMGetInstanceFieldHandle(benchmark::State& state) {
+  sq::VM vm;
+  vm.compile("class A { field = 42 }; return A();");
+  vm.pushRootTable();
+  vm.call(1, true);
+  const sq::VM::FieldHandle field = vm.getFieldHandle("field");
+  for (auto _: state)
+    benchmark::DoNotOptimize(vm.getIntField(field));
+}
+BENCHMARK(BM_VMGetInstanceFieldHandle);
+
+static void BM_VMPushField(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushNewTable();
+  vm.makeSlot("field", SQInteger(42));
+  for (auto _: state) {
+    vm.pushField("field");
+    vm.pop();
+  }
+}
+BENCHMARK(BM_VMPushField);
+
+// Containers
+
+static void BM_RawPushVector(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  const std::vector<double> data(state.range(0), 1.0);
+  for (auto _: state) {
+    sq_newarray(v, 0);
+    for (double value: data) {
+      sq_pushfloat(v, value);
+      sq_arrayappend(v, -2);
+    }
+    sq_pop(v, 1);
+  }
+}
+BENCHMARK(BM_RawPushVector)->Arg(100000);
+
+static void BM_VMPushVector(benchmark::State& state) {
+  sq::VM vm;
+  const std::vector<double> data(state.range(0), 1.0);
+  for (auto _: state) {
+    vm.push(data);
+    vm.pop();
+  }
+}
+BENCHMARK(BM_VMPushVector)->Arg(100000);
+
+static void BM_VMGetVector(benchmark::State& state) {
+  sq::VM vm;
+  vm.push(std::vector<double>(state.range(0), 1.0));
+  for (auto _: state)
+    benchmark::DoNotOptimize(vm.get<std::vector<double>>());
+}
+BENCHMARK(BM_VMGetVector)->Arg(100000);
+
+// Any
+
+static void BM_RawObjectRef(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  HSQOBJECT obj;
+  sq_newtable(v);
+  sq_getstackobj(v, -1, &obj);
+  sq_addref(v, &obj);
+  sq_pop(v, 1);
+  for (auto _: state) {
+    HSQOBJECT copy = obj;
+    sq_addref(v, &copy);
+    sq_release(v, &copy);
+  }
+  sq_release(v, &obj);
+}
+BENCHMARK(BM_RawObjectRef);
+
+static void BM_VMAnyCopy(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushNewTable();
+  const sq::VM::Any any(&vm);
+  vm.pop();
+  for (auto _: state) {
+    sq::VM::Any copy(any);
+    benchmark::DoNotOptimize(copy);
+  }
+}
+BENCHMARK(BM_VMAnyCopy);
+
+static void BM_VMAnyAssign(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushNewTable();
+  const sq::VM::Any first(&vm);
+  vm.pushNewTable();
+  const sq::VM::Any second(&vm);
+  vm.pop(2);
+  sq::VM::Any target(first);
+  for (auto _: state) {
+    target = second;
+    target = first;
+  }
+}
+BENCHMARK(BM_VMAnyAssign);
+
+static void BM_VMAnyMove(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushNewTable();
+  sq::VM::Any first(&vm);
+  vm.pop();
+  sq::VM::Any second;
+  for (auto _: state) {
+    second = std::move(first);
+    first = std::move(second);
+  }
+}
+BENCHMARK(BM_VMAnyMove);
+
+static void BM_VMAnyRefGet(benchmark::State& state) {
+  sq::VM vm;
+  vm << SQInteger(42);
+  for (auto _: state) {
+    const sq::VM::AnyRef ref(&vm);
+    benchmark::DoNotOptimize(ref.get<SQInteger>());
+  }
+}
+BENCHMARK(BM_VMAnyRefGet);
+
+// Calls
+
+static void BM_RawCallScript(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  vm.exec(ADD_SCRIPT, "bench");
+  HSQOBJECT add = getRootSlot(v, "add");
+  for (auto _: state) {
+    SQInteger value;
+    sq_pushobject(v, add);
+    sq_pushroottable(v);
+    sq_pushinteger(v, 1);
+    sq_pushinteger(v, 2);
+    sq_call(v, 3, SQTrue, SQTrue);
+    sq_getinteger(v, -1, &value);
+    sq_pop(v, 2);
+    benchmark::DoNotOptimize(value);
+  }
+  sq_release(v, &add);
+}
+BENCHMARK(BM_RawCallScript);
+
+static void BM_VMCallScript(benchmark::State& state) {
+  sq::VM vm;
+  vm.exec(ADD_SCRIPT, "bench");
+  vm.pushRootTable();
+  vm.pushField("add");
+  for (auto _: state) {
+    SQInteger value;
+    vm.push(-1);
+    vm.pushRootTable();
+    vm << SQInteger(1) << SQInteger(2);
+    vm.call(3, true);
+    vm >> value;
+    vm.pop();
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_VMCallScript);
+
+static void BM_RawCallNative(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  sq_newclosure(v, &rawAdd, 0);
+  for (auto _: state) {
+    SQInteger value;
+    sq_push(v, -1);
+    sq_pushroottable(v);
+    sq_pushinteger(v, 1);
+    sq_pushinteger(v, 2);
+    sq_call(v, 3, SQTrue, SQTrue);
+    sq_getinteger(v, -1, &value);
+    sq_pop(v, 2);
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_RawCallNative);
+
+static void BM_VMCallNative(benchmark::State& state) {
+  sq::VM vm;
+  vm.pushFunction([](SQInteger a, SQInteger b) { return a + b; });
+  for (auto _: state) {
+    SQInteger value;
+    vm.push(-1);
+    vm.pushRootTable();
+    vm << SQInteger(1) << SQInteger(2);
+    vm.call(3, true);
+    vm >> value;
+    vm.pop();
+    benchmark::DoNotOptimize(value);
+  }
+}
+BENCHMARK(BM_VMCallNative);
+
+// toString
+
+static void BM_RawTableToString(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  pushTable(v, state.range(0));
+  for (auto _: state) {
+    std::string result("{");
+    sq_pushnull(v);
+    while (SQ_SUCCEEDED(sq_next(v, -2))) {
+      const SQChar* str;
+      SQInteger size;
+      if (result.size() > 1) result += ", ";
+      sq_tostring(v, -2);
+      sq_getstringandsize(v, -1, &str, &size);
+      result.append(str, size);
+      result += '=';
+      sq_tostring(v, -2);
+      sq_getstringandsize(v, -1, &str, &size);
+      result.append(str, size);
+      sq_pop(v, 4);
+    }
+    sq_pop(v, 1);
+    result += '}';
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_RawTableToString)->Arg(100)->Arg(10000);
+
+static void BM_VMTableToString(benchmark::State& state) {
+  sq::VM vm;
+  pushTable(vm.handle(), state.range(0));
+  for (auto _: state)
+    benchmark::DoNotOptimize(vm.toString());
+}
+BENCHMARK(BM_VMTableToString)->Arg(100)->Arg(10000);
+
+// Compilation
+
+static void BM_RawCompile(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  for (auto _: state) {
+    sq_compilebuffer(v, ADD_SCRIPT, std::strlen(ADD_SCRIPT), "bench", SQTrue);
+    sq_pop(v, 1);
+  }
+}
+BENCHMARK(BM_RawCompile);
+
+// Arg is the compile cache limit, 0 compiles every time
+static void BM_VMCompile(benchmark::State& state) {
+  sq::VM vm;
+  vm.setCompileCacheLimit(state.range(0));
+  for (auto _: state) {
+    vm.compile(ADD_SCRIPT, "bench");
+    vm.pop();
+  }
+}
+BENCHMARK(BM_VMCompile)->Arg(0)->Arg(256);
+
+static void BM_RawExec(benchmark::State& state) {
+  sq::VM vm;
+  HSQUIRRELVM v = vm.handle();
+  for (auto _: state) {
+    sq_compilebuffer(v, ADD_SCRIPT, std::strlen(ADD_SCRIPT), "bench", SQTrue);
+    sq_pushroottable(v);
+    sq_call(v, 1, SQFalse, SQTrue);
+    sq_pop(v, 1);
+  }
+}
+BENCHMARK(BM_RawExec);
+
+static void BM_VMExec(benchmark::State& state) {
+  sq::VM vm;
+  vm.setCompileCacheLimit(state.range(0));
+  for (auto _: state)
+    vm.exec(ADD_SCRIPT, "bench");
+}
+BENCHMARK(BM_VMExec)->Arg(0)->Arg(256);
+
+// VM construction, with the same libraries the wrapper registers
+
+static void BM_RawConstruct(benchmark::State& state) {
+  for (auto _: state) {
+    HSQUIRRELVM v = sq_open(1024);
+    sqstd_seterrorhandlers(v);
+    sq_enabledebuginfo(v, SQTrue);
+    sq_pushroottable(v);
+    sqstd_register_iolib(v);
+    sqstd_register_mathlib(v);
+    sqstd_register_stringlib(v);
+    sqstd_register_systemlib(v);
+    sqstd_register_bloblib(v);
+    sq::registerExternalBlobLib(v);
+    sq::registerJsonLib(v);
+    sq_close(v);
+  }
+}
+BENCHMARK(BM_RawConstruct);
+
+static void BM_VMConstruct(benchmark::State& state) {
+  for (auto _: state)
+    sq::VM vm;
+}
+BENCHMARK(BM_VMConstruct);
+
+BENCHMARK_MAIN();
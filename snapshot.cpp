@@ -0,0 +1,81 @@
+#include "sq_script_loader.h"
+#include "sq_snapshot.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+// Runs initialization scripts once and stores what they left in the root
+// table, so hosts can start with VM(handler, stackSize, allocator, snapshot).
+//
+// squirrel_cpp_snapshot -o <snapshot> [-m <manifest>] [-d <dir>] [script ...]
+
+namespace {
+
+class ConsoleOutput: public sq::VM::PrintHandler {
+public:
+  void onSqPrintData(sq::VM* vm, const char* data, size_t size) override {
+    std::cout.write(data, size);
+  }
+
+  void onSqErrorData(sq::VM* vm, const char* data, size_t size) override {
+    std::cerr.write(data, size) << '\n';
+  }
+
+  void onSqCompileError(
+         sq::VM* vm,
+         const std::string& desc,
+         const std::string& source,
+         SQInteger line,
+         SQInteger column) override {
+    std::cerr << desc << " in " << source << " on line " << line << " column " << column << std::endl;
+  }
+};
+
+int usage() {
+  std::cerr << "Usage: squirrel_cpp_snapshot -o <snapshot> [-m <manifest>] [-d <dir>] [script ...]" << std::endl;
+  return 2;
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string output;
+  sq::ScriptLoader loader;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const bool hasValue = i + 1 < argc;
+      if (!std::strcmp(argv[i], "-o") && hasValue) output = argv[++i];
+      else if (!std::strcmp(argv[i], "-m") && hasValue) loader.addManifest(argv[++i]);
+      else if (!std::strcmp(argv[i], "-d") && hasValue) loader.addDirectory(argv[++i]);
+      else if (argv[i][0] == '-') return usage();
+      else loader.addFile(argv[i]);
+    }
+    if (output.empty() || loader.files().empty()) return usage();
+
+    ConsoleOutput console;
+    sq::VM vm(&console);
+    sq::SnapshotWriter snapshot(vm);
+    const auto start = std::chrono::steady_clock::now();
+    loader.load(vm);
+    const auto loaded = std::chrono::steady_clock::now();
+    snapshot.writeToFile(output);
+
+    for (const std::string& skipped: snapshot.skipped())
+      std::cerr << "Skipped " << skipped << std::endl;
+
+    // Restore once to report the startup time the snapshot buys
+    const auto restoreStart = std::chrono::steady_clock::now();
+    sq::VM restored(nullptr, 1024, nullptr, output);
+    const auto restoreEnd = std::chrono::steady_clock::now();
+    auto ms = [](std::chrono::steady_clock::duration d) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0;
+    };
+    std::cout << loader.files().size() << " scripts loaded in " << ms(loaded - start)
+              << " ms, snapshot restores in " << ms(restoreEnd - restoreStart) << " ms" << std::endl;
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
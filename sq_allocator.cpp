@@ -0,0 +1,251 @@
+#include "sq_allocator.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include "squirrel.h"
+
+namespace sq {
+
+namespace {
+
+thread_local Allocator* currentAllocator = nullptr;
+
+inline size_t roundUp(size_t size, size_t granularity) {
+  return (size + granularity - 1) / granularity * granularity;
+}
+
+}
+
+// Allocator
+
+void* Allocator::reallocate(void* p, size_t oldSize, size_t newSize) {
+  void* result = allocate(newSize);
+  if (!result) return nullptr;
+  if (p) {
+    std::memcpy(result, p, std::min(oldSize, newSize));
+    deallocate(p, oldSize);
+  }
+  return result;
+}
+
+Allocator* Allocator::current() {
+  return currentAllocator;
+}
+
+void Allocator::onAllocate(size_t size) {
+  counters.bytes += size;
+  counters.peakBytes = std::max(counters.peakBytes, counters.bytes);
+  ++counters.allocations;
+  ++counters.totalAllocations;
+}
+
+void Allocator::onReallocate(size_t oldSize, size_t newSize) {
+  counters.bytes += newSize - oldSize;
+  counters.peakBytes = std::max(counters.peakBytes, counters.bytes);
+  ++counters.totalAllocations;
+}
+
+void Allocator::onDeallocate(size_t size) {
+  counters.bytes -= size;
+  --counters.allocations;
+}
+
+Allocator* Allocator::Scope::enter(Allocator* allocator) {
+#ifndef SQVM_CUSTOM_ALLOCATOR
+  throw std::logic_error("Custom allocators need SQVM_CUSTOM_ALLOCATOR build");
+#endif
+  Allocator* previous = currentAllocator;
+  currentAllocator = allocator;
+  return previous;
+}
+
+void Allocator::Scope::leave(Allocator* previous) {
+  currentAllocator = previous;
+}
+
+// PoolAllocator
+
+const size_t PoolAllocator::GRANULARITY;
+const size_t PoolAllocator::MAX_POOLED;
+const size_t PoolAllocator::CHUNK_SIZE;
+
+PoolAllocator::~PoolAllocator() {
+  for (void* chunk: chunks)
+    std::free(chunk);
+}
+
+void* PoolAllocator::allocate(size_t size) {
+  size = roundUp(std::max<size_t>(size, 1), GRANULARITY);
+  if (size > MAX_POOLED) {
+    return std::malloc(size);
+  }
+
+  FreeBlock*& list = freeLists[size / GRANULARITY - 1];
+  if (list) {
+    FreeBlock* result = list;
+    list = result->next;
+    return result;
+  }
+
+  if (chunkEnd - chunkPos < static_cast<std::ptrdiff_t>(size)) {
+    char* chunk = reinterpret_cast<char*>(std::malloc(CHUNK_SIZE));
+    if (!chunk) return nullptr;
+    try {
+      chunks.push_back(chunk);
+    } catch (std::bad_alloc&) {
+      std::free(chunk);
+      return nullptr;
+    }
+    // The tail of the old chunk goes to the free lists it fits
+    while (chunkEnd - chunkPos >= static_cast<std::ptrdiff_t>(GRANULARITY)) {
+      const size_t tail = std::min<size_t>(chunkEnd - chunkPos, MAX_POOLED);
+      deallocate(chunkPos, tail / GRANULARITY * GRANULARITY);
+      chunkPos += tail / GRANULARITY * GRANULARITY;
+    }
+    chunkPos = chunk;
+    chunkEnd = chunk + CHUNK_SIZE;
+  }
+  void* result = chunkPos;
+  chunkPos += size;
+  return result;
+}
+
+void PoolAllocator::deallocate(void* p, size_t size) {
+  size = roundUp(std::max<size_t>(size, 1), GRANULARITY);
+  if (size > MAX_POOLED) {
+    std::free(p);
+    return;
+  }
+  FreeBlock* block = reinterpret_cast<FreeBlock*>(p);
+  FreeBlock*& list = freeLists[size / GRANULARITY - 1];
+  block->next = list;
+  list = block;
+}
+
+// ArenaAllocator
+
+const size_t ArenaAllocator::BLOCK_SIZE;
+
+ArenaAllocator::~ArenaAllocator() {
+  for (void* block: blocks)
+    std::free(block);
+}
+
+void* ArenaAllocator::allocate(size_t size) {
+  size = roundUp(std::max<size_t>(size, 1), 16);
+  if (end - pos < static_cast<std::ptrdiff_t>(size)) {
+    const size_t blockSize = std::max(size, BLOCK_SIZE);
+    char* block = reinterpret_cast<char*>(std::malloc(blockSize));
+    if (!block) return nullptr;
+    try {
+      blocks.push_back(block);
+    } catch (std::bad_alloc&) {
+      std::free(block);
+      return nullptr;
+    }
+    pos = block;
+    end = block + blockSize;
+  }
+  last = pos;
+  pos += size;
+  return last;
+}
+
+void* ArenaAllocator::reallocate(void* p, size_t oldSize, size_t newSize) {
+  // The most recent block grows in place while there's room
+  if (p && (p == last) &&
+      (end - last >= static_cast<std::ptrdiff_t>(roundUp(newSize, 16)))) {
+    pos = last + roundUp(std::max<size_t>(newSize, 1), 16);
+    return p;
+  }
+  return Allocator::reallocate(p, oldSize, newSize);
+}
+
+void ArenaAllocator::reset() {
+  // Keep the first block for the next request
+  if (blocks.empty()) return;
+  for (size_t i = 1; i < blocks.size(); ++i)
+    std::free(blocks[i]);
+  blocks.resize(1);
+  pos = reinterpret_cast<char*>(blocks.front());
+  end = pos + BLOCK_SIZE;
+  last = nullptr;
+  counters = Stats();
+}
+
+}
+
+#ifdef SQVM_CUSTOM_ALLOCATOR
+
+// Squirrel memory hooks. Each block is prefixed with its owner and size,
+// blocks allocated with no current allocator use malloc. Exceptions of
+// user allocators must not cross Squirrel's C code.
+
+namespace {
+
+struct alignas(16) BlockHeader {
+  sq::Allocator* owner;
+  size_t size;
+};
+
+inline BlockHeader* headerOf(void* p) {
+  return reinterpret_cast<BlockHeader*>(p) - 1;
+}
+
+}
+
+void* sq_vm_malloc(SQUnsignedInteger size) {
+  sq::Allocator* allocator = sq::Allocator::current();
+  const size_t total = size + sizeof(BlockHeader);
+  BlockHeader* header = nullptr;
+  try {
+    header = reinterpret_cast<BlockHeader*>(
+        allocator? allocator->allocate(total): std::malloc(total));
+  } catch (...) {
+  }
+  if (!header) return nullptr;
+  header->owner = allocator;
+  header->size = size;
+  if (allocator) allocator->onAllocate(size);
+  return header + 1;
+}
+
+void* sq_vm_realloc(void* p, SQUnsignedInteger oldSize, SQUnsignedInteger size) {
+  if (!p) return sq_vm_malloc(size);
+  BlockHeader* header = headerOf(p);
+  sq::Allocator* allocator = header->owner;
+  const size_t old = header->size;
+  const size_t total = size + sizeof(BlockHeader);
+  try {
+    header = reinterpret_cast<BlockHeader*>(allocator?
+        allocator->reallocate(header, old + sizeof(BlockHeader), total):
+        std::realloc(header, total));
+  } catch (...) {
+    header = nullptr;
+  }
+  if (!header) return nullptr;
+  header->size = size;
+  if (allocator) allocator->onReallocate(old, size);
+  return header + 1;
+}
+
+void sq_vm_free(void* p, SQUnsignedInteger size) {
+  if (!p) return;
+  BlockHeader* header = headerOf(p);
+  sq::Allocator* allocator = header->owner;
+  if (allocator) {
+    allocator->onDeallocate(header->size);
+    try {
+      allocator->deallocate(header, header->size + sizeof(BlockHeader));
+    } catch (...) {
+    }
+  } else {
+    std::free(header);
+  }
+}
+
+#endif
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace sq {
+
+// Memory backend for Squirrel VMs. Squirrel's sq_vm_malloc/realloc/free are
+// global, so they are routed to the allocator that is current on the calling
+// thread (see Scope, a null scope keeps the current one). VM wrappers make
+// the VM's allocator current while they run, so VMs with different
+// allocators can share a thread; code calling sq_* on VM::handle() directly
+// should hold a Scope of VM::getAllocator().
+// Every block remembers its owner, so frees always go to the right allocator.
+// allocate() and reallocate() are called from Squirrel's C code, they return
+// null when out of memory instead of throwing.
+// Requires SQVM_CUSTOM_ALLOCATOR and squirrel built with
+// SQ_EXCLUDE_DEFAULT_MEMFUNCTIONS.
+class Allocator {
+public:
+  struct Stats {
+    size_t bytes = 0;
+    size_t peakBytes = 0;
+    size_t allocations = 0;
+    size_t totalAllocations = 0;
+  };
+
+  class Scope;
+
+  Allocator() = default;
+  Allocator(const Allocator&) = delete;
+  virtual ~Allocator() {}
+
+  virtual void* allocate(size_t size) = 0;
+  virtual void deallocate(void* p, size_t size) = 0;
+  virtual void* reallocate(void* p, size_t oldSize, size_t newSize);
+
+  inline const Stats& stats() const { return counters; }
+
+  static Allocator* current();
+
+  // Called by the Squirrel memory hooks
+  void onAllocate(size_t size);
+  void onReallocate(size_t oldSize, size_t newSize);
+  void onDeallocate(size_t size);
+
+protected:
+  Stats counters;
+};
+
+class Allocator::Scope {
+public:
+  explicit Scope(Allocator* allocator)
+      : previous(allocator? enter(allocator): nullptr), active(allocator != nullptr) {}
+  Scope(const Scope&) = delete;
+  ~Scope() {
+    if (active) leave(previous);
+  }
+
+private:
+  // Both return or take the previously current allocator
+  static Allocator* enter(Allocator* allocator);
+  static void leave(Allocator* previous);
+
+  Allocator* previous;
+  bool active;
+};
+
+// Size-class free lists for small blocks, larger blocks go to malloc
+class PoolAllocator: public Allocator {
+public:
+  static const size_t GRANULARITY = 16;
+  static const size_t MAX_POOLED = 512;
+  static const size_t CHUNK_SIZE = 64 * 1024;
+
+  PoolAllocator() = default;
+  ~PoolAllocator() override;
+
+  void* allocate(size_t size) override;
+  void deallocate(void* p, size_t size) override;
+
+private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  FreeBlock* freeLists[MAX_POOLED / GRANULARITY] = {};
+  std::vector<void*> chunks;
+  char* chunkPos = nullptr;
+  char* chunkEnd = nullptr;
+};
+
+// Bump allocator, memory is released only by reset() or destruction.
+// Reset it between requests once the VM using it is closed.
+class ArenaAllocator: public Allocator {
+public:
+  static const size_t BLOCK_SIZE = 256 * 1024;
+
+  ArenaAllocator() = default;
+  ~ArenaAllocator() override;
+
+  void* allocate(size_t size) override;
+  void deallocate(void* p, size_t size) override {}
+  void* reallocate(void* p, size_t oldSize, size_t newSize) override;
+  void reset();
+
+private:
+  std::vector<void*> blocks;
+  char* pos = nullptr;
+  char* end = nullptr;
+  char* last = nullptr;
+};
+
+}
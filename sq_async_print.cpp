@@ -0,0 +1,127 @@
+#include "sq_async_print.h"
+
+#include <utility>
+
+namespace sq {
+
+AsyncPrintHandler::AsyncPrintHandler(VM::PrintHandler* target)
+    : AsyncPrintHandler(target, Options()) {
+}
+
+AsyncPrintHandler::AsyncPrintHandler(VM::PrintHandler* target, const Options& options)
+    : target(target), options(options) {
+  pending.data.reserve(options.flushBytes);
+  spare.data.reserve(options.flushBytes);
+  flusher = std::thread(&AsyncPrintHandler::run, this);
+}
+
+AsyncPrintHandler::~AsyncPrintHandler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    wakeUp.notify_one();
+    drained.notify_all();
+  }
+  flusher.join();
+}
+
+void AsyncPrintHandler::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!pending.chunks.empty()) deliverPending(lock);
+  drained.wait(lock, [this]() { return !delivering; });
+}
+
+void AsyncPrintHandler::onSqPrintData(VM* vm, const char* data, size_t size) {
+  append(vm, false, data, size);
+}
+
+void AsyncPrintHandler::onSqErrorData(VM* vm, const char* data, size_t size) {
+  append(vm, true, data, size);
+}
+
+void AsyncPrintHandler::onSqCompileError(
+                          VM* vm,
+                          const std::string& desc,
+                          const std::string& source,
+                          SQInteger line,
+                          SQInteger column) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!pending.chunks.empty()) deliverPending(lock);
+  drained.wait(lock, [this]() { return !delivering; });
+  delivering = true;
+  lock.unlock();
+  try {
+    target->onSqCompileError(vm, desc, source, line, column);
+  } catch (...) {
+  }
+  lock.lock();
+  delivering = false;
+  drained.notify_all();
+}
+
+void AsyncPrintHandler::append(VM* vm, bool error, const char* data, size_t size) {
+  std::unique_lock<std::mutex> lock(mutex);
+  drained.wait(lock, [this]() {
+    return (pending.data.size() < options.maxPendingBytes) || stopping;
+  });
+  const bool first = pending.chunks.empty();
+  if (first) firstPending = std::chrono::steady_clock::now();
+  // Errors stay separate messages, handlers may terminate each one
+  Chunk* last = first? nullptr: &pending.chunks.back();
+  if (last && !error && !last->error && (last->vm == vm)) {
+    last->size += size;
+  } else {
+    pending.chunks.push_back(Chunk{vm, error, pending.data.size(), size});
+  }
+  pending.data.append(data, size);
+  if (first || (pending.data.size() >= options.flushBytes))
+    wakeUp.notify_one();
+}
+
+void AsyncPrintHandler::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    if (pending.chunks.empty()) {
+      if (stopping) return;
+      wakeUp.wait(lock);
+      continue;
+    }
+    const std::chrono::steady_clock::time_point deadline = firstPending + options.flushInterval;
+    if (!stopping && (pending.data.size() < options.flushBytes) &&
+        (std::chrono::steady_clock::now() < deadline)) {
+      wakeUp.wait_until(lock, deadline);
+      continue;
+    }
+    deliverPending(lock);
+  }
+}
+
+void AsyncPrintHandler::deliverPending(std::unique_lock<std::mutex>& lock) {
+  // One delivery at a time keeps batches in order
+  drained.wait(lock, [this]() { return !delivering; });
+  if (pending.chunks.empty()) return;
+  delivering = true;
+  Batch batch = std::move(spare);
+  std::swap(batch, pending);
+  drained.notify_all();
+  lock.unlock();
+
+  try {
+    for (const Chunk& chunk: batch.chunks) {
+      const char* data = batch.data.data() + chunk.offset;
+      if (chunk.error) target->onSqErrorData(chunk.vm, data, chunk.size);
+      else target->onSqPrintData(chunk.vm, data, chunk.size);
+    }
+  } catch (...) {
+    // The batch is dropped, the script thread that printed is long gone
+  }
+  batch.data.clear();
+  batch.chunks.clear();
+
+  lock.lock();
+  spare = std::move(batch);
+  delivering = false;
+  drained.notify_all();
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace sq {
+
+// Print handler that takes output off the script threads. Messages are
+// appended to a batch, consecutive messages of one VM and kind are
+// coalesced, and a background thread hands the batch to the target handler
+// once it holds flushBytes or flushInterval has passed. Writers block only
+// while maxPendingBytes are waiting for the target.
+// The target is called from one thread at a time. The VM pointers it gets
+// identify the source only, the VM may be gone by the time of delivery.
+// Compile errors are delivered synchronously, after what was queued before.
+class AsyncPrintHandler: public VM::PrintHandler {
+public:
+  struct Options {
+    size_t flushBytes = 64 * 1024;
+    std::chrono::milliseconds flushInterval{50};
+    size_t maxPendingBytes = 16 * 1024 * 1024;
+  };
+
+  explicit AsyncPrintHandler(VM::PrintHandler* target);
+  AsyncPrintHandler(VM::PrintHandler* target, const Options& options);
+  AsyncPrintHandler(const AsyncPrintHandler&) = delete;
+  // Delivers what's left
+  ~AsyncPrintHandler();
+
+  // Delivers everything queued so far before returning
+  void flush();
+
+  void onSqPrintData(VM* vm, const char* data, size_t size) override;
+  void onSqErrorData(VM* vm, const char* data, size_t size) override;
+  void onSqCompileError(
+         VM* vm,
+         const std::string& desc,
+         const std::string& source,
+         SQInteger line,
+         SQInteger column) override;
+
+private:
+  struct Chunk {
+    VM* vm;
+    bool error;
+    size_t offset;
+    size_t size;
+  };
+
+  struct Batch {
+    std::string data;
+    std::vector<Chunk> chunks;
+  };
+
+  void append(VM* vm, bool error, const char* data, size_t size);
+  void run();
+  // Takes the pending batch and delivers it, lock holds the state mutex
+  void deliverPending(std::unique_lock<std::mutex>& lock);
+
+  VM::PrintHandler* target;
+  Options options;
+
+  std::mutex mutex;
+  std::condition_variable wakeUp;
+  std::condition_variable drained;
+  Batch pending;
+  Batch spare;
+  bool delivering = false;
+  bool stopping = false;
+  std::chrono::steady_clock::time_point firstPending;
+
+  std::thread flusher;
+};
+
+}
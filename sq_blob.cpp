@@ -0,0 +1,155 @@
+#include "sq_blob.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace sq {
+
+namespace {
+
+const SQChar* const CLASS_KEY = "sq_externalblob";
+
+SQInteger releaseBlob(SQUserPointer p, SQInteger) {
+  delete reinterpret_cast<ExternalBlob*>(p);
+  return 1;
+}
+
+ExternalBlob* getSelf(HSQUIRRELVM v) {
+  SQUserPointer self = nullptr;
+  if (!SQ_SUCCEEDED(sq_getinstanceup(v, 1, &self, detail::typeTag<ExternalBlob>())) || !self)
+    return nullptr;
+  return reinterpret_cast<ExternalBlob*>(self);
+}
+
+SQInteger blobConstructor(HSQUIRRELVM v) {
+  return sq_throwerror(v, "External blobs are created by the host only");
+}
+
+SQInteger blobCloned(HSQUIRRELVM v) {
+  return sq_throwerror(v, "External blobs can't be cloned");
+}
+
+// Byte access, other keys are not found
+SQInteger blobGet(HSQUIRRELVM v) {
+  ExternalBlob* self = getSelf(v);
+  SQInteger idx;
+  if (!self || (sq_gettype(v, 2) != OT_INTEGER)) {
+    sq_pushnull(v);
+    return sq_throwobject(v);
+  }
+  sq_getinteger(v, 2, &idx);
+  if ((idx < 0) || (static_cast<size_t>(idx) >= self->size))
+    return sq_throwerror(v, "Index out of range");
+  sq_pushinteger(v, self->data[idx]);
+  return 1;
+}
+
+SQInteger blobSet(HSQUIRRELVM v) {
+  ExternalBlob* self = getSelf(v);
+  SQInteger idx, value;
+  if (!self || (sq_gettype(v, 2) != OT_INTEGER) || (sq_gettype(v, 3) != OT_INTEGER)) {
+    sq_pushnull(v);
+    return sq_throwobject(v);
+  }
+  if (!self->writable)
+    return sq_throwerror(v, "Blob is read-only");
+  sq_getinteger(v, 2, &idx);
+  sq_getinteger(v, 3, &value);
+  if ((idx < 0) || (static_cast<size_t>(idx) >= self->size))
+    return sq_throwerror(v, "Index out of range");
+  self->data[idx] = static_cast<unsigned char>(value);
+  return 0;
+}
+
+SQInteger blobTypeOf(HSQUIRRELVM v) {
+  sq_pushstring(v, "blob", -1);
+  return 1;
+}
+
+void addMethod(HSQUIRRELVM v, const SQChar* name, SQFUNCTION func) {
+  sq_pushstring(v, name, -1);
+  sq_newclosure(v, func, 0);
+  sq_setnativeclosurename(v, -1, name);
+  sq_newslot(v, -3, SQFalse);
+}
+
+}
+
+ExternalBlob::ExternalBlob(void* data, size_t size, bool writable, VM::BlobRelease release)
+    : data(reinterpret_cast<unsigned char*>(data)), size(size), writable(writable),
+      release(std::move(release)) {}
+
+ExternalBlob::~ExternalBlob() {
+  if (release) release(data, size);
+}
+
+SQInteger ExternalBlob::Read(void* buffer, SQInteger count) {
+  const SQInteger n = std::min(count, Len() - pos);
+  if (n <= 0) return 0;
+  std::memcpy(buffer, data + pos, n);
+  pos += n;
+  return n;
+}
+
+SQInteger ExternalBlob::Write(void* buffer, SQInteger count) {
+  if (!writable) return 0;
+  const SQInteger n = std::min(count, Len() - pos);
+  if (n <= 0) return 0;
+  std::memcpy(data + pos, buffer, n);
+  pos += n;
+  return n;
+}
+
+SQInteger ExternalBlob::Seek(SQInteger offset, SQInteger origin) {
+  SQInteger target;
+  switch (origin) {
+  case SQ_SEEK_SET: target = offset; break;
+  case SQ_SEEK_CUR: target = pos + offset; break;
+  case SQ_SEEK_END: target = Len() + offset; break;
+  default: return -1;
+  }
+  if ((target < 0) || (target > Len())) return -1;
+  pos = target;
+  return 0;
+}
+
+SQRESULT registerExternalBlobLib(HSQUIRRELVM v) {
+  const SQInteger top = sq_gettop(v);
+  sq_pushregistrytable(v);
+  sq_pushstring(v, CLASS_KEY, -1);
+  // Base class left in the registry by the blob library
+  sq_pushstring(v, "std_stream", -1);
+  if (!SQ_SUCCEEDED(sq_rawget(v, -3))) {
+    sq_settop(v, top);
+    return sq_throwerror(v, "Blob library is not registered");
+  }
+  sq_newclass(v, SQTrue);
+  sq_settypetag(v, -1, detail::typeTag<ExternalBlob>());
+  addMethod(v, "constructor", &blobConstructor);
+  addMethod(v, "_cloned", &blobCloned);
+  addMethod(v, "_get", &blobGet);
+  addMethod(v, "_set", &blobSet);
+  addMethod(v, "_typeof", &blobTypeOf);
+  const SQRESULT result = sq_newslot(v, -3, SQFalse);
+  sq_settop(v, top);
+  return result;
+}
+
+void pushExternalBlob(HSQUIRRELVM v, ExternalBlob* blob) {
+  const SQInteger top = sq_gettop(v);
+  sq_pushregistrytable(v);
+  sq_pushstring(v, CLASS_KEY, -1);
+  if (!SQ_SUCCEEDED(sq_rawget(v, -2)) || !SQ_SUCCEEDED(sq_createinstance(v, -1))) {
+    sq_settop(v, top);
+    delete blob;
+    throw std::logic_error("External blob class is not registered");
+  }
+  sq_setinstanceup(v, -1, blob);
+  sq_setreleasehook(v, -1, &releaseBlob);
+  // Drop the registry and the class under the instance
+  sq_remove(v, -2);
+  sq_remove(v, -2);
+}
+
+}
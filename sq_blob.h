@@ -0,0 +1,42 @@
+#pragma once
+
+#include "sq_vm.h"
+
+namespace sq {
+
+// Memory owned by C++ as seen by scripts, without copying. sqstdblob can't
+// wrap foreign buffers, so this is a std_stream subclass: scripts get the
+// stream methods (readn, writen, seek, tell, len, readblob...) plus byte
+// indexing. It can't grow, writes past the end are short.
+// The release callback runs when the script object is collected.
+class ExternalBlob: public SQStream {
+public:
+  ExternalBlob(void* data, size_t size, bool writable, VM::BlobRelease release);
+  ExternalBlob(const ExternalBlob&) = delete;
+  ~ExternalBlob();
+
+  SQInteger Read(void* buffer, SQInteger count) override;
+  SQInteger Write(void* buffer, SQInteger count) override;
+  SQInteger Flush() override { return 0; }
+  SQInteger Tell() override { return pos; }
+  SQInteger Len() override { return static_cast<SQInteger>(size); }
+  SQInteger Seek(SQInteger offset, SQInteger origin) override;
+  bool IsValid() override { return true; }
+  bool EOS() override { return pos >= Len(); }
+
+  unsigned char* const data;
+  const size_t size;
+  const bool writable;
+
+private:
+  VM::BlobRelease release;
+  SQInteger pos = 0;
+};
+
+// Registers the class in the registry, needs the blob library first
+SQRESULT registerExternalBlobLib(HSQUIRRELVM v);
+
+// Pushes an instance taking ownership of blob
+void pushExternalBlob(HSQUIRRELVM v, ExternalBlob* blob);
+
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sq {
+
+// Registers C++ class T as a Squirrel class. T is stored inline in the
+// instance user data (sq_setclassudsize), so creating an object is a single
+// allocation, and the class is tagged with detail::typeTag<T>() so instance
+// pointers are checked on every downcast. The release hook is set once T
+// is constructed and marks it: methods and properties reject instances
+// whose constructor didn't run (a script subclass not calling
+// base.constructor()), and the constructor rejects a second call.
+//
+// Usage (table to put the class into is on top of the stack):
+//   ClassBinder<Foo>(&vm, "Foo")
+//     .constructor<int>()
+//     .method("bar", &Foo::bar)
+//     .property("x", &Foo::x)
+//     .bind();
+template <typename T>
+class ClassBinder {
+public:
+  ClassBinder(VM* vm, const std::string& name);
+
+  template <typename ... Args>
+  ClassBinder& constructor();
+  template <typename M>
+  ClassBinder& method(const std::string& name, M method);
+  template <typename V>
+  ClassBinder& property(const std::string& name, V T::* member);
+  template <typename R>
+  ClassBinder& property(const std::string& name, R (T::*getter)() const);
+  template <typename R, typename V>
+  ClassBinder& property(const std::string& name, R (T::*getter)() const, void (T::*setter)(V));
+  template <typename R>
+  ClassBinder& toString(R (T::*method)() const);
+  void bind();
+
+  template <typename ... Args>
+  static T* pushNew(VM* vm, SQInteger classIdx, Args&& ... args);
+  static T* get(const VM* vm, SQInteger idx = -1);
+
+private:
+  struct Property {
+    std::function<SQInteger(HSQUIRRELVM, T*)> get;
+    std::function<SQInteger(HSQUIRRELVM, T*)> set;
+  };
+  // Sorted by name, so lookups compare the key in place
+  typedef std::vector<std::pair<std::string, Property>> PropertyMap;
+
+  template <typename ... Args>
+  struct Construct {
+    void* self;
+    void operator () (Args ... args) const {
+      new(self) T(std::forward<Args>(args) ...);
+    }
+  };
+
+  void defaultConstructor(std::true_type) { constructor<>(); }
+  void defaultConstructor(std::false_type) {}
+
+  Property& addProperty(const std::string& name);
+  static SQInteger getProperty(HSQUIRRELVM v);
+  static SQInteger setProperty(HSQUIRRELVM v);
+  static Property* findProperty(HSQUIRRELVM v, T** self);
+
+  VM* vm;
+  PropertyMap properties;
+  bool hasConstructor = false;
+};
+
+template <typename T>
+inline ClassBinder<T>::ClassBinder(VM* vm, const std::string& name): vm(vm) {
+  static_assert(alignof(T) <= alignof(SQInteger),
+                "Inline instance storage is aligned to SQInteger only");
+  (*vm) << name;
+  vm->pushNewClass(false);
+  vm->setClassUDSize(sizeof(T));
+  vm->setTypeTag(detail::typeTag<T>());
+}
+
+template <typename T>
+template <typename ... Args>
+inline ClassBinder<T>& ClassBinder<T>::constructor() {
+  typedef detail::Signature<void, Args ...> Traits;
+  struct Impl {
+    static SQInteger call(HSQUIRRELVM v) {
+      try {
+        SQUserPointer self;
+        if (!SQ_SUCCEEDED(sq_getinstanceup(v, 1, &self, detail::typeTag<T>())))
+          return sq_throwerror(v, "Constructor called on instance of wrong class");
+        if (sq_getreleasehook(v, 1) == &detail::releaseBound<T>)
+          return sq_throwerror(v, "Constructor called on constructed instance");
+        Construct<Args ...> construct = {self};
+        Traits::Invoke::call(v, construct, typename Traits::Index());
+        sq_setreleasehook(v, 1, &detail::releaseBound<T>);
+        return 0;
+      } catch (std::exception& e) {
+        return sq_throwerror(v, e.what());
+      }
+    }
+  };
+  (*vm) << lit::CONSTRUCTOR;
+  vm->pushRawClosure(&Impl::call);
+  vm->setParameterCheck(Traits::paramCount, Traits::template typeMask<'x'>());
+  vm->newSlot();
+  hasConstructor = true;
+  return *this;
+}
+
+template <typename T>
+template <typename M>
+inline ClassBinder<T>& ClassBinder<T>::method(const std::string& name, M method) {
+  (*vm) << name;
+  vm->pushMethod(method);
+  vm->newSlot();
+  return *this;
+}
+
+template <typename T>
+template <typename V>
+inline ClassBinder<T>& ClassBinder<T>::property(const std::string& name, V T::* member) {
+  Property& property = addProperty(name);
+  property.get = [member](HSQUIRRELVM v, T* self) {
+    return detail::RetOf<V>::push(v, self->*member);
+  };
+  property.set = [member](HSQUIRRELVM v, T* self) -> SQInteger {
+    if (!detail::ArgOf<V>::is(v, 3))
+      return sq_throwerror(v, "Wrong property value type");
+    self->*member = detail::ArgOf<V>::get(v, 3);
+    return 0;
+  };
+  return *this;
+}
+
+template <typename T>
+template <typename R>
+inline ClassBinder<T>& ClassBinder<T>::property(const std::string& name, R (T::*getter)() const) {
+  Property& property = addProperty(name);
+  property.get = [getter](HSQUIRRELVM v, T* self) {
+    return detail::RetOf<R>::push(v, (self->*getter)());
+  };
+  property.set = nullptr;
+  return *this;
+}
+
+template <typename T>
+template <typename R, typename V>
+inline ClassBinder<T>& ClassBinder<T>::property(
+    const std::string& name, R (T::*getter)() const, void (T::*setter)(V)) {
+  property(name, getter);
+  addProperty(name).set = [setter](HSQUIRRELVM v, T* self) -> SQInteger {
+    if (!detail::ArgOf<V>::is(v, 3))
+      return sq_throwerror(v, "Wrong property value type");
+    (self->*setter)(detail::ArgOf<V>::get(v, 3));
+    return 0;
+  };
+  return *this;
+}
+
+template <typename T>
+template <typename R>
+inline ClassBinder<T>& ClassBinder<T>::toString(R (T::*method)() const) {
+  return this->method(lit::TO_STRING, method);
+}
+
+template <typename T>
+inline typename ClassBinder<T>::Property& ClassBinder<T>::addProperty(const std::string& name) {
+  auto found = std::lower_bound(
+      properties.begin(), properties.end(), name,
+      [](const std::pair<std::string, Property>& item, const std::string& name) {
+        return item.first < name;
+      });
+  if ((found == properties.end()) || (found->first != name))
+    found = properties.insert(found, std::make_pair(name, Property()));
+  return found->second;
+}
+
+template <typename T>
+inline void ClassBinder<T>::bind() {
+  if (!hasConstructor)
+    defaultConstructor(std::is_default_constructible<T>());
+  if (!properties.empty()) {
+    (*vm) << lit::GET;
+    vm->pushUserValue<PropertyMap>(properties);
+    vm->pushRawClosure(&getProperty, 1);
+    vm->newSlot();
+    (*vm) << lit::SET;
+    vm->pushUserValue<PropertyMap>(properties);
+    vm->pushRawClosure(&setProperty, 1);
+    vm->newSlot();
+  }
+  vm->newSlot();
+}
+
+template <typename T>
+template <typename ... Args>
+inline T* ClassBinder<T>::pushNew(VM* vm, SQInteger classIdx, Args&& ... args) {
+  vm->pushInstance(classIdx);
+  T* self = vm->getInstancePtr<T*>(-1, detail::typeTag<T>());
+  new(self) T(std::forward<Args>(args) ...);
+  vm->setReleaseHook(&detail::releaseBound<T>);
+  return self;
+}
+
+template <typename T>
+inline T* ClassBinder<T>::get(const VM* vm, SQInteger idx) {
+  T* result = detail::boundInstance<T>(vm->handle(), idx);
+  if (!result)
+    throw VM::Error(vm, idx, VM::Error::Static("Expected constructed instance of bound class"),
+                    vm->valueTypeName(idx));
+  return result;
+}
+
+// _get and _set get (instance, key[, value]) with the property map as
+// the free variable on top
+template <typename T>
+inline typename ClassBinder<T>::Property* ClassBinder<T>::findProperty(HSQUIRRELVM v, T** self) {
+  SQUserPointer map;
+  const SQChar* key;
+  SQInteger size;
+  *self = detail::boundInstance<T>(v, 1);
+  if (!*self || !SQ_SUCCEEDED(sq_getstringandsize(v, 2, &key, &size)))
+    return nullptr;
+  sq_getuserdata(v, -1, &map, nullptr);
+  PropertyMap& properties = *reinterpret_cast<PropertyMap*>(map);
+  auto found = std::lower_bound(
+      properties.begin(), properties.end(), VM::StringView(key, size),
+      [](const std::pair<std::string, Property>& item, VM::StringView name) {
+        return item.first.compare(0, item.first.size(), name.data(), name.size()) < 0;
+      });
+  if ((found == properties.end()) || (VM::StringView(found->first) != VM::StringView(key, size)))
+    return nullptr;
+  return &found->second;
+}
+
+template <typename T>
+inline SQInteger ClassBinder<T>::getProperty(HSQUIRRELVM v) {
+  try {
+    T* self;
+    Property* property = findProperty(v, &self);
+    if (!property) {
+      sq_pushnull(v);
+      return sq_throwobject(v);
+    }
+    return property->get(v, self);
+  } catch (std::exception& e) {
+    return sq_throwerror(v, e.what());
+  }
+}
+
+template <typename T>
+inline SQInteger ClassBinder<T>::setProperty(HSQUIRRELVM v) {
+  try {
+    T* self;
+    Property* property = findProperty(v, &self);
+    if (!property) {
+      sq_pushnull(v);
+      return sq_throwobject(v);
+    }
+    if (!property->set)
+      return sq_throwerror(v, "Property is read-only");
+    return property->set(v, self);
+  } catch (std::exception& e) {
+    return sq_throwerror(v, e.what());
+  }
+}
+
+}
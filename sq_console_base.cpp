@@ -1,17 +1,28 @@
 #include "sq_console_base.h"
 
-#include <boost/algorithm/string.hpp>
-
 namespace sq {
 
+namespace {
+
+inline bool isSpace(char c) {
+  return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '\f') || (c == '\v');
+}
+
+void trim(const char*& begin, const char*& end) {
+  while ((begin < end) && isSpace(*begin)) ++begin;
+  while ((end > begin) && isSpace(end[-1])) --end;
+}
+
+}
+
 std::string ConsoleBase::interpretCommand() {
-  boost::trim(currentCommand);
+  // Lines are trimmed when they are added
   if (retVal) {
-    while (!currentCommand.empty() && currentCommand.back() == ';') {
-      currentCommand.erase(currentCommand.size() - 1, 1);
-      boost::trim(currentCommand);
-    }
-    currentCommand = (boost::format("return (%1%)") % currentCommand).str();
+    const char* begin = currentCommand.data();
+    const char* end = begin + currentCommand.size();
+    while ((end > begin) && ((end[-1] == ';') || isSpace(end[-1])))
+      --end;
+    currentCommand = "return (" + std::string(begin, end) + ")";
   }
 
   vm->printHandler = this;
@@ -40,37 +51,44 @@ std::string ConsoleBase::interpretCommand() {
 }
 
 bool ConsoleBase::isCommandComplete(const std::string& command) {
-  std::string part = command;
-  boost::trim(part);
+  return isCommandComplete(command.data(), command.size());
+}
+
+// Scans only the new line, the state of the text before it is kept in
+// blocks and inString
+bool ConsoleBase::isCommandComplete(const char* line, size_t size) {
+  const char* begin = line;
+  const char* end = line + size;
+  trim(begin, end);
   if (currentCommand.empty()) {
     blocks = 0;
     inString = '\0';
     retVal = false;
-    if (part.front() == '=') {
-      part.erase(0, 1);
-      boost::trim(part);
+    if ((begin < end) && (*begin == '=')) {
+      ++begin;
+      trim(begin, end);
       retVal = true;
     }
   }
-  if (part.empty()) return false;
+  if (begin == end) return false;
 
-  for (int i = 0; i < part.size(); ++i) {
-    const char c = part[i];
+  for (const char* p = begin; p < end; ++p) {
+    const char c = *p;
     if (inString == '@') {
       if (c == '"') {
-        if ((i + 1 < part.size()) && (part[i + 1] == '"'))
-          ++i;
+        if ((p + 1 < end) && (p[1] == '"'))
+          ++p;
         else
           inString = '\0';
       }
     } else if (inString != '\0') {
       if (c == inString) inString = '\0';
-      else if (c == '\\') ++i;
+      else if (c == '\\') ++p;
     } else if ((c == '\'') || (c == '"'))
       inString = c;
-    else if ((c == '@') && (i + 1 < part.size()) && (part[i + 1] == '"')) {
+    else if ((c == '@') && (p + 1 < end) && (p[1] == '"')) {
       inString = '@';
-      ++i;
+      ++p;
     }
     else if (c == '}') blocks--;
     else if (c == '{') blocks++;
@@ -78,15 +96,15 @@ bool ConsoleBase::isCommandComplete(const std::string& command) {
 
   bool doIt = (blocks <= 0) && (inString != '@');
 
-  if (part.back() == '\\') {
-    part.erase(part.size() - 1, 1);
-    if (!inString) part.push_back('\n');
+  if (end[-1] == '\\') {
+    currentCommand.append(begin, end - 1);
+    if (!inString) currentCommand.push_back('\n');
     doIt = false;
-  } else part.push_back('\n');
-
-  currentCommand += part;
+  } else {
+    currentCommand.append(begin, end);
+    currentCommand.push_back('\n');
+  }
   return doIt;
 }
 
 }
-
@@ -12,7 +12,9 @@ public:
   }
 
   std::string interpretCommand();
+  // Adds a line to currentCommand, true once it is a complete command
   bool isCommandComplete(const std::string& command);
+  bool isCommandComplete(const char* line, size_t size);
 
   VM* vm;
 
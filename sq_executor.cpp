@@ -0,0 +1,186 @@
+#include "sq_executor.h"
+#include "sq_script_loader.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace sq {
+
+class ScriptExecutor::LockedPrintHandler: public VM::PrintHandler {
+public:
+  explicit LockedPrintHandler(VM::PrintHandler* handler): handler(handler) {}
+
+  void onSqPrintData(VM* vm, const char* data, size_t size) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    handler->onSqPrintData(vm, data, size);
+  }
+
+  void onSqErrorData(VM* vm, const char* data, size_t size) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    handler->onSqErrorData(vm, data, size);
+  }
+
+  void onSqCompileError(
+         VM* vm,
+         const std::string& desc,
+         const std::string& source,
+         SQInteger line,
+         SQInteger column) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    handler->onSqCompileError(vm, desc, source, line, column);
+  }
+
+private:
+  VM::PrintHandler* handler;
+  std::mutex mutex;
+};
+
+static void pinThread(size_t index) {
+#ifdef __linux__
+  const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(index % cores, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+ScriptExecutor::ScriptExecutor(): ScriptExecutor(Options()) {
+}
+
+ScriptExecutor::ScriptExecutor(const Options& options)
+    : options(options), queue(options.queueCapacity), pending(0), sleeping(0), stopping(false) {
+  if (options.printHandler)
+    printHandler.reset(new LockedPrintHandler(options.printHandler));
+
+  // Compile preloaded scripts once in parallel, workers only load the bytecode
+  ScriptLoader loader;
+  for (const std::string& file: options.preloadFiles)
+    loader.addFile(file);
+  const std::vector<ScriptLoader::Script> scripts = loader.compile();
+
+  size_t count = options.workers;
+  if (!count) count = std::max(1u, std::thread::hardware_concurrency());
+
+  // Wait for all workers to boot so initialization errors are reported here
+  std::mutex readyMutex;
+  std::condition_variable readyCondition;
+  size_t ready = 0;
+  std::exception_ptr error;
+  try {
+    workers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+      workers.emplace_back([&, i]() {
+        std::unique_ptr<VM> vm;
+        std::exception_ptr initError;
+        try {
+          if (this->options.pinThreads) pinThread(i);
+          vm.reset(new VM(printHandler.get()));
+          for (const ScriptLoader::Script& script: scripts) {
+            const int top = vm->getTop();
+            vm->readClosure(script.bytecode);
+            vm->pushRootTable();
+            vm->call(1, false);
+            vm->setTop(top);
+          }
+          if (this->options.init) this->options.init(*vm);
+        } catch (...) {
+          initError = std::current_exception();
+          vm.reset();
+        }
+        {
+          // Notify under the lock, the constructor's locals die once it wakes
+          std::lock_guard<std::mutex> lock(readyMutex);
+          if (initError && !error) error = initError;
+          ++ready;
+          readyCondition.notify_one();
+        }
+        if (vm) run(*vm);
+      });
+    }
+  } catch (...) {
+    // Started workers use the locals above, they must finish first
+    stop();
+    throw;
+  }
+
+  std::unique_lock<std::mutex> lock(readyMutex);
+  readyCondition.wait(lock, [&]() { return ready == count; });
+  if (error) {
+    lock.unlock();
+    stop();
+    std::rethrow_exception(error);
+  }
+}
+
+ScriptExecutor::~ScriptExecutor() {
+  stop();
+}
+
+std::future<void> ScriptExecutor::exec(const std::string& code, const std::string& fileName) {
+  return submit([code, fileName](VM& vm) { vm.exec(code, fileName); });
+}
+
+void ScriptExecutor::enqueue(Job&& job) {
+  // pending is raised before the push so it never underflows in workers,
+  // and before the check so workers can't exit with the job queued
+  pending.fetch_add(1);
+  if (stopping.load()) {
+    pending.fetch_sub(1);
+    throw VM::Error(nullptr, 0, VM::Error::Static("ScriptExecutor is stopped"));
+  }
+  while (!queue.push(std::move(job)))
+    std::this_thread::yield();
+  if (sleeping.load() > 0) {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    wakeUp.notify_one();
+  }
+}
+
+void ScriptExecutor::run(VM& vm) {
+  GarbageCollector gc(vm, options.gcPolicy);
+  bool collect = options.collectGarbage;
+  Job job;
+  for (;;) {
+    if (queue.pop(job)) {
+      pending.fetch_sub(1);
+      try {
+        job(vm);
+      } catch (...) {
+        // submit() jobs report through their futures
+      }
+      job = nullptr;
+      if (collect) {
+        try {
+          gc.afterRequest();
+        } catch (VM::Error&) {
+          // Squirrel built without the collector
+          collect = false;
+        }
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    if (stopping.load() && (pending.load() == 0)) return;
+    sleeping.fetch_add(1);
+    wakeUp.wait(lock, [this]() { return (pending.load() > 0) || stopping.load(); });
+    sleeping.fetch_sub(1);
+  }
+}
+
+void ScriptExecutor::stop() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stopping.store(true);
+    wakeUp.notify_all();
+  }
+  for (std::thread& worker: workers)
+    if (worker.joinable()) worker.join();
+  workers.clear();
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "sq_vm.h"
+#include "sq_gc.h"
+#include "sq_mpmc_queue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sq {
+
+// Runs script jobs on a fixed set of worker threads, each owning its own VM.
+// Jobs are taken from a lock-free queue and get the worker's VM; results
+// come back through futures. Preload files are compiled once and their
+// bytecode is executed in every worker VM. The print handler is shared by
+// all workers, so calls to it are serialized. Workers collect garbage
+// cycles between jobs when the GC policy allows.
+class ScriptExecutor {
+public:
+  typedef std::function<void(VM&)> Job;
+  typedef std::function<void(VM&)> Initializer;
+
+  struct Options {
+    size_t workers = 0;  // 0 - one per hardware thread
+    bool pinThreads = true;
+    size_t queueCapacity = 4096;
+    std::vector<std::string> preloadFiles;
+    Initializer init;  // runs on each worker after preloading
+    VM::PrintHandler* printHandler = nullptr;
+    // Cycle collection between jobs, see GarbageCollector
+    bool collectGarbage = true;
+    GarbageCollector::Policy gcPolicy;
+  };
+
+  ScriptExecutor();
+  explicit ScriptExecutor(const Options& options);
+  ScriptExecutor(const ScriptExecutor&) = delete;
+  ~ScriptExecutor();
+
+  // Both throw VM::Error once the executor is being destroyed
+  template <typename F>
+  std::future<typename std::result_of<F(VM&)>::type> submit(F job);
+  std::future<void> exec(const std::string& code, const std::string& fileName = "job");
+
+  inline size_t workerCount() const { return workers.size(); }
+
+private:
+  class LockedPrintHandler;
+
+  void enqueue(Job&& job);
+  void run(VM& vm);
+  void stop();
+
+  Options options;
+  MPMCQueue<Job> queue;
+  std::atomic<size_t> pending;
+  std::atomic<size_t> sleeping;
+  std::atomic<bool> stopping;
+  std::mutex sleepMutex;
+  std::condition_variable wakeUp;
+  std::unique_ptr<LockedPrintHandler> printHandler;
+  std::vector<std::thread> workers;
+};
+
+template <typename F>
+inline std::future<typename std::result_of<F(VM&)>::type> ScriptExecutor::submit(F job) {
+  typedef typename std::result_of<F(VM&)>::type R;
+  std::shared_ptr<std::packaged_task<R(VM&)>> task =
+      std::make_shared<std::packaged_task<R(VM&)>>(std::move(job));
+  std::future<R> result = task->get_future();
+  enqueue([task](VM& vm) { (*task)(vm); });
+  return result;
+}
+
+}
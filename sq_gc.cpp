@@ -0,0 +1,171 @@
+#include "sq_gc.h"
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+
+namespace sq {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const size_t MAX_DESCRIPTION = 60;
+
+// Leak description without running script code (no _tostring)
+std::string describe(HSQUIRRELVM v) {
+  switch (sq_gettype(v, -1)) {
+  case OT_STRING: {
+    const SQChar* str;
+    SQInteger size;
+    sq_getstringandsize(v, -1, &str, &size);
+    std::string result = "\"" + std::string(str, std::min<size_t>(size, MAX_DESCRIPTION));
+    return result + ((size_t(size) > MAX_DESCRIPTION)? "...\"": "\"");
+  }
+  case OT_CLOSURE:
+  case OT_NATIVECLOSURE: {
+    std::string result;
+    const SQChar* name;
+    if (SQ_SUCCEEDED(sq_getclosurename(v, -1))) {
+      if (SQ_SUCCEEDED(sq_getstring(v, -1, &name))) result = name;
+      sq_pop(v, 1);
+    }
+    return result.empty()? "<anonymous>": result;
+  }
+  case OT_TABLE:
+  case OT_ARRAY:
+    return std::to_string(sq_getsize(v, -1)) + " slots";
+  case OT_CLASS:
+  case OT_INSTANCE: {
+    // sq_getsize is the userdata size for these
+    size_t members = 0;
+    sq_pushnull(v);
+    while (SQ_SUCCEEDED(sq_next(v, -2))) {
+      ++members;
+      sq_pop(v, 2);
+    }
+    sq_pop(v, 1);
+    return std::to_string(members) + " members";
+  }
+  default:
+    return std::string();
+  }
+}
+
+}
+
+GarbageCollector::GarbageCollector(VM& vm): GarbageCollector(vm, Policy()) {
+}
+
+GarbageCollector::GarbageCollector(VM& vm, const Policy& policy)
+    : vm(vm), policy(policy) {
+  counters.bytesAfterCollection = heapBytes();
+}
+
+SQInteger GarbageCollector::collect() {
+  const Clock::time_point start = Clock::now();
+  const SQInteger collected = vm.collectGarbage();
+  const std::chrono::microseconds pause =
+      std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+  if (collected < 0)
+    throw VM::Error(&vm, 0, VM::Error::Static("Garbage collector is not available"));
+  ++counters.collections;
+  counters.collected += collected;
+  counters.lastCollected = collected;
+  counters.requests = 0;
+  counters.bytesAfterCollection = heapBytes();
+  counters.lastPause = pause;
+  counters.maxPause = std::max(counters.maxPause, pause);
+  counters.totalPause += pause;
+  return collected;
+}
+
+bool GarbageCollector::afterRequest() {
+  ++counters.requests;
+  if (!isDue()) return false;
+  if ((counters.requests < policy.forceInterval) && (expectedPause() > policy.budget))
+    return false;
+  collect();
+  return true;
+}
+
+bool GarbageCollector::isDue() const {
+  if (policy.requestInterval && (counters.requests >= policy.requestInterval))
+    return true;
+  return policy.bytesGrowth &&
+         (heapBytes() >= counters.bytesAfterCollection + policy.bytesGrowth);
+}
+
+std::chrono::microseconds GarbageCollector::expectedPause() const {
+  // Marking is proportional to the live heap
+  const size_t bytes = heapBytes();
+  if (!counters.bytesAfterCollection || (bytes <= counters.bytesAfterCollection))
+    return counters.lastPause;
+  return std::chrono::microseconds(
+           counters.lastPause.count() * bytes / counters.bytesAfterCollection);
+}
+
+std::vector<GarbageCollector::Leak> GarbageCollector::findLeaks() {
+  Allocator::Scope allocatorScope(vm.getAllocator());
+  HSQUIRRELVM v = vm.handle();
+  const SQInteger top = sq_gettop(v);
+  if (!vm.resurrectUnreachable())
+    throw VM::Error(&vm, 0, VM::Error::Static("Garbage collector is not available"));
+  std::vector<Leak> leaks;
+  if (sq_gettype(v, -1) == OT_ARRAY) {
+    const SQInteger size = sq_getsize(v, -1);
+    leaks.reserve(size);
+    for (SQInteger i = 0; i < size; ++i) {
+      sq_pushinteger(v, i);
+      if (!SQ_SUCCEEDED(sq_rawget(v, -2))) continue;
+      leaks.push_back(Leak{VM::typeName(sq_gettype(v, -1)), describe(v)});
+      sq_pop(v, 1);
+    }
+  }
+  // The objects are garbage again once the array is gone
+  sq_settop(v, top);
+  collect();
+  return leaks;
+}
+
+void GarbageCollector::writeLeakReport(std::ostream& out, const std::vector<Leak>& leaks, size_t limit) {
+  if (leaks.empty()) {
+    out << "No unreachable objects\n";
+    return;
+  }
+  std::map<std::string, size_t> byType;
+  for (const Leak& leak: leaks)
+    ++byType[leak.type];
+  out << leaks.size() << " unreachable objects:";
+  for (const auto& type: byType)
+    out << ' ' << type.second << ' ' << type.first;
+  out << '\n';
+  for (size_t i = 0; i < std::min(limit, leaks.size()); ++i) {
+    out << "  " << leaks[i].type;
+    if (!leaks[i].description.empty()) out << ' ' << leaks[i].description;
+    out << '\n';
+  }
+  if (leaks.size() > limit)
+    out << "  ... " << (leaks.size() - limit) << " more\n";
+}
+
+void GarbageCollector::writeStats(std::ostream& out) const {
+  out << "Collections: " << counters.collections
+      << ", collected objects: " << counters.collected
+      << " (last " << counters.lastCollected << ")\n"
+      << "Pause us: last " << counters.lastPause.count()
+      << ", max " << counters.maxPause.count()
+      << ", total " << counters.totalPause.count() << '\n'
+      << "Requests since collection: " << counters.requests;
+  if (vm.getAllocator())
+    out << ", heap bytes: " << heapBytes()
+        << " (" << counters.bytesAfterCollection << " after collection)";
+  out << '\n';
+}
+
+size_t GarbageCollector::heapBytes() const {
+  Allocator* allocator = vm.getAllocator();
+  return allocator? allocator->stats().bytes: 0;
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <chrono>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace sq {
+
+// Schedules cycle collection of one VM between requests instead of leaving
+// cycles to pile up until an arbitrary collection lands mid-request.
+// afterRequest() collects once the policy says it is due (request count or
+// heap growth, the latter needs a VM allocator) and the expected pause fits
+// in the budget; the expectation is the last pause scaled by heap growth.
+// A collection that never fits is forced after forceInterval requests.
+//
+// Usage:
+//   GarbageCollector gc(vm);
+//   for (;;) { handle(request); gc.afterRequest(); }
+class GarbageCollector {
+public:
+  struct Policy {
+    size_t requestInterval = 64;
+    size_t bytesGrowth = 4 * 1024 * 1024;
+    std::chrono::microseconds budget{2000};
+    size_t forceInterval = 4096;
+  };
+
+  struct Stats {
+    size_t collections = 0;
+    size_t collected = 0;  // objects in cycles, all collections
+    SQInteger lastCollected = 0;
+    size_t requests = 0;   // since the last collection
+    size_t bytesAfterCollection = 0;
+    std::chrono::microseconds lastPause{0};
+    std::chrono::microseconds maxPause{0};
+    std::chrono::microseconds totalPause{0};
+  };
+
+  struct Leak {
+    const char* type;
+    std::string description;
+  };
+
+  explicit GarbageCollector(VM& vm);
+  GarbageCollector(VM& vm, const Policy& policy);
+  GarbageCollector(const GarbageCollector&) = delete;
+
+  // Returns the number of collected objects, throws VM::Error when the VM
+  // has no collector
+  SQInteger collect();
+  // Returns true if it collected
+  bool afterRequest();
+  bool isDue() const;
+  std::chrono::microseconds expectedPause() const;
+
+  inline const Stats& stats() const { return counters; }
+  inline const Policy& getPolicy() const { return policy; }
+  inline void setPolicy(const Policy& p) { policy = p; }
+
+  // Objects only reachable from cycles right now. They are described, then
+  // collected, so this is also a collection (counted in stats).
+  std::vector<Leak> findLeaks();
+  static void writeLeakReport(std::ostream& out, const std::vector<Leak>& leaks, size_t limit = 50);
+  void writeStats(std::ostream& out) const;
+
+private:
+  size_t heapBytes() const;
+
+  VM& vm;
+  Policy policy;
+  Stats counters;
+};
+
+}
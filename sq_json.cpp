@@ -0,0 +1,458 @@
+#include "sq_json.h"
+
+#include "sq_vm.h"
+
+#include <algorithm>
+#include <clocale>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace sq {
+
+namespace {
+
+// mask is not zero
+inline int firstBit(unsigned mask) {
+#if defined(__GNUC__)
+  return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+  unsigned long bit;
+  _BitScanForward(&bit, mask);
+  return static_cast<int>(bit);
+#else
+  int bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+inline bool isDigit(char c) {
+  return (c >= '0') && (c <= '9');
+}
+
+// Powers of ten that are exact doubles
+const double exactPowers[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool isWhitespace(char c) {
+  return (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t');
+}
+
+const char* skipWhitespace(const char* p, const char* end) {
+  // Most gaps are a single space or none
+  if ((p < end) && !isWhitespace(*p)) return p;
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i tab = _mm_set1_epi8('\t');
+  while (end - p >= 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, newline)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, tab)));
+    const unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(ws)) & 0xffff;
+    if (mask) return p + firstBit(mask);
+    p += 16;
+  }
+#endif
+  while ((p < end) && isWhitespace(*p)) ++p;
+  return p;
+}
+
+// First quote, backslash or control character
+const char* scanString(const char* p, const char* end) {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+    if (mask) return p + firstBit(mask);
+    p += 16;
+  }
+#endif
+  while ((p < end) && (*p != '"') && (*p != '\\') && (static_cast<unsigned char>(*p) >= 0x20))
+    ++p;
+  return p;
+}
+
+void appendUtf8(std::string& out, unsigned code) {
+  if (code < 0x80) {
+    out += static_cast<char>(code);
+  } else if (code < 0x800) {
+    out += static_cast<char>(0xc0 | (code >> 6));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  } else if (code < 0x10000) {
+    out += static_cast<char>(0xe0 | (code >> 12));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  } else {
+    out += static_cast<char>(0xf0 | (code >> 18));
+    out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  }
+}
+
+// Values are pushed onto the VM stack as they are parsed. When a container
+// closes its elements are counted, so it's created presized, filled with
+// raw sets and put in place of its elements. Nesting uses an explicit
+// level stack.
+class Parser {
+public:
+  Parser(HSQUIRRELVM v, const char* begin, const char* end)
+      : v(v), begin(begin), p(begin), end(end) {}
+
+  void parse() {
+    for (;;) {
+      value();
+      for (;;) {
+        if (levels.empty()) {
+          p = skipWhitespace(p, end);
+          if (p != end) fail("Unexpected data after JSON value");
+          return;
+        }
+        p = skipWhitespace(p, end);
+        const Level& level = levels.back();
+        if (p == end) fail("Unterminated container");
+        if (*p == ',') {
+          ++p;
+          if (!level.isArray) key();
+          break;
+        }
+        if (*p != (level.isArray? ']': '}')) fail("Expected , or end of container");
+        ++p;
+        close();
+      }
+    }
+  }
+
+private:
+  struct Level {
+    bool isArray;
+    SQInteger base;
+  };
+
+  void value() {
+    for (;;) {
+      p = skipWhitespace(p, end);
+      if (p == end) fail("Unexpected end of JSON");
+      switch (*p) {
+      case '[':
+      case '{': {
+        const bool isArray = (*p++ == '[');
+        const Level level = {isArray, sq_gettop(v)};
+        levels.push_back(level);
+        p = skipWhitespace(p, end);
+        if ((p < end) && (*p == (isArray? ']': '}'))) {
+          ++p;
+          close();
+          return;
+        }
+        if (isArray) continue;
+        key();
+        continue;
+      }
+      case '"':
+        reserve();
+        string();
+        return;
+      case 't':
+        literal("true", 4);
+        sq_pushbool(v, SQTrue);
+        return;
+      case 'f':
+        literal("false", 5);
+        sq_pushbool(v, SQFalse);
+        return;
+      case 'n':
+        literal("null", 4);
+        sq_pushnull(v);
+        return;
+      default:
+        number();
+        return;
+      }
+    }
+  }
+
+  void key() {
+    p = skipWhitespace(p, end);
+    if ((p == end) || (*p != '"')) fail("Expected string key");
+    reserve();
+    string();
+    p = skipWhitespace(p, end);
+    if ((p == end) || (*p != ':')) fail("Expected :");
+    ++p;
+  }
+
+  void close() {
+    const Level level = levels.back();
+    levels.pop_back();
+    const SQInteger top = sq_gettop(v);
+    const SQInteger count = top - level.base;
+    reserve();
+    if (level.isArray) {
+      sq_newarray(v, count);
+      for (SQInteger i = 0; i < count; ++i) {
+        sq_pushinteger(v, i);
+        sq_push(v, level.base + 1 + i);
+        sq_rawset(v, -3);
+      }
+    } else {
+      sq_newtableex(v, count / 2);
+      for (SQInteger i = level.base + 1; i < top; i += 2) {
+        sq_push(v, i);
+        sq_push(v, i + 1);
+        sq_rawset(v, -3);
+      }
+    }
+    // Replace the elements with the container
+    HSQOBJECT container;
+    sq_getstackobj(v, -1, &container);
+    sq_addref(v, &container);
+    sq_settop(v, level.base);
+    sq_pushobject(v, container);
+    sq_release(v, &container);
+  }
+
+  void string() {
+    ++p;
+    const char* start = p;
+    p = scanString(p, end);
+    if ((p < end) && (*p == '"')) {
+      // No escapes, straight from the input
+      sq_pushstring(v, start, p - start);
+      ++p;
+      return;
+    }
+
+    buffer.assign(start, p);
+    for (;;) {
+      if (p == end) fail("Unterminated string");
+      const char c = *p++;
+      if (c == '"') break;
+      if (c != '\\') fail("Control character in string");
+      if (p == end) fail("Unterminated string");
+      switch (*p++) {
+      case '"':  buffer += '"'; break;
+      case '\\': buffer += '\\'; break;
+      case '/':  buffer += '/'; break;
+      case 'b':  buffer += '\b'; break;
+      case 'f':  buffer += '\f'; break;
+      case 'n':  buffer += '\n'; break;
+      case 'r':  buffer += '\r'; break;
+      case 't':  buffer += '\t'; break;
+      case 'u': {
+        unsigned code = hex4();
+        if ((code >= 0xd800) && (code < 0xdc00)) {
+          if ((end - p < 2) || (p[0] != '\\') || (p[1] != 'u')) fail("Unpaired surrogate");
+          p += 2;
+          const unsigned low = hex4();
+          if ((low < 0xdc00) || (low >= 0xe000)) fail("Unpaired surrogate");
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+        }
+        appendUtf8(buffer, code);
+        break;
+      }
+      default:
+        fail("Unknown escape sequence");
+      }
+      start = p;
+      p = scanString(p, end);
+      buffer.append(start, p);
+    }
+    sq_pushstring(v, buffer.data(), buffer.size());
+  }
+
+  unsigned hex4() {
+    if (end - p < 4) fail("Short \\u escape");
+    unsigned code = 0;
+    for (int i = 0; i < 4; ++i) {
+      const char c = *p++;
+      code <<= 4;
+      if ((c >= '0') && (c <= '9')) code |= c - '0';
+      else if ((c >= 'a') && (c <= 'f')) code |= c - 'a' + 10;
+      else if ((c >= 'A') && (c <= 'F')) code |= c - 'A' + 10;
+      else fail("Bad \\u escape");
+    }
+    return code;
+  }
+
+  // The JSON grammar: no leading zeros, digits on both sides of the point.
+  // Digits accumulate into the mantissa while it's exact; integers that fit
+  // stay integers, floats with a small exponent take one exact multiply or
+  // divide, the rest go to strtod.
+  void number() {
+    const char* start = p;
+    const bool negative = (*p == '-');
+    if (negative) ++p;
+    if ((p == end) || !isDigit(*p)) fail("Unexpected character");
+
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    bool exact = true;
+    if (*p == '0') {
+      ++p;
+      if ((p < end) && isDigit(*p)) fail("Leading zero in number");
+    } else {
+      while ((p < end) && isDigit(*p)) {
+        if (!exact || !addDigit(mantissa, *p)) {
+          exact = false;
+          ++exponent;
+        }
+        ++p;
+      }
+    }
+    bool fraction = false;
+    if ((p < end) && (*p == '.')) {
+      ++p;
+      if ((p == end) || !isDigit(*p)) fail("Expected digit after decimal point");
+      fraction = true;
+      while ((p < end) && isDigit(*p)) {
+        if (exact && addDigit(mantissa, *p)) --exponent;
+        else exact = false;
+        ++p;
+      }
+    }
+    if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+      ++p;
+      const bool negativeExponent = (p < end) && (*p == '-');
+      if ((p < end) && ((*p == '-') || (*p == '+'))) ++p;
+      if ((p == end) || !isDigit(*p)) fail("Expected digit in exponent");
+      fraction = true;
+      int value = 0;
+      while ((p < end) && isDigit(*p)) {
+        // Far beyond the double range either way
+        if (value < 100000) value = value * 10 + (*p - '0');
+        ++p;
+      }
+      exponent += negativeExponent? -value: value;
+    }
+
+    reserve();
+    const unsigned long long limit =
+        static_cast<unsigned long long>(~0ULL >> (65 - sizeof(SQInteger) * 8)) + (negative? 1: 0);
+    if (!fraction && exact && (mantissa <= limit)) {
+      sq_pushinteger(v, negative? static_cast<SQInteger>(0 - mantissa): static_cast<SQInteger>(mantissa));
+      return;
+    }
+
+    double result;
+    if (exact && (mantissa < (1ULL << 53)) && (exponent >= -22) && (exponent <= 22)) {
+      result = static_cast<double>(mantissa);
+      if (exponent < 0) result /= exactPowers[-exponent];
+      else result *= exactPowers[exponent];
+      if (negative) result = -result;
+    } else {
+      // strtod expects the locale's decimal point
+      std::string text(start, p);
+      std::replace(text.begin(), text.end(), '.', *std::localeconv()->decimal_point);
+      result = std::strtod(text.c_str(), nullptr);
+    }
+    sq_pushfloat(v, static_cast<SQFloat>(result));
+  }
+
+  // False if the digit doesn't fit
+  static bool addDigit(unsigned long long& mantissa, char c) {
+    const unsigned digit = c - '0';
+    if (mantissa > (~0ULL - digit) / 10) return false;
+    mantissa = mantissa * 10 + digit;
+    return true;
+  }
+
+  void literal(const char* text, size_t size) {
+    if ((static_cast<size_t>(end - p) < size) || std::memcmp(p, text, size))
+      fail("Unexpected character");
+    p += size;
+    reserve();
+  }
+
+  // sq_reservestack grows to the exact size asked, so grow geometrically
+  void reserve() {
+    const SQInteger top = sq_gettop(v);
+    if (top + 4 <= reserved) return;
+    const SQInteger grow = (top > 256)? top: 256;
+    if (!SQ_SUCCEEDED(sq_reservestack(v, grow)))
+      throw std::runtime_error("Can't grow stack");
+    reserved = top + grow;
+  }
+
+  [[noreturn]] void fail(const char* message) {
+    throw std::runtime_error(std::string(message) + " at offset " + std::to_string(p - begin));
+  }
+
+  HSQUIRRELVM v;
+  const char* begin;
+  const char* p;
+  const char* end;
+  std::vector<Level> levels;
+  std::string buffer;
+  SQInteger reserved = 0;
+};
+
+SQInteger jsonParse(HSQUIRRELVM v) {
+  const SQChar* str;
+  SQInteger size;
+  sq_getstringandsize(v, 2, &str, &size);
+  try {
+    Parser(v, str, str + size).parse();
+    return 1;
+  } catch (std::exception& e) {
+    return sq_throwerror(v, e.what());
+  }
+}
+
+SQInteger jsonStringify(HSQUIRRELVM v) {
+  try {
+    std::string result;
+    VM::inst(v)->toString(result, 2, VM::JSON);
+    sq_pushstring(v, result.data(), result.size());
+    return 1;
+  } catch (std::exception& e) {
+    return sq_throwerror(v, e.what());
+  }
+}
+
+}
+
+SQRESULT registerJsonLib(HSQUIRRELVM v) {
+  sq_pushstring(v, "json", -1);
+  sq_newtable(v);
+
+  sq_pushstring(v, "parse", -1);
+  sq_newclosure(v, &jsonParse, 0);
+  sq_setparamscheck(v, 2, ".s");
+  sq_setnativeclosurename(v, -1, "parse");
+  sq_newslot(v, -3, SQFalse);
+
+  sq_pushstring(v, "stringify", -1);
+  sq_newclosure(v, &jsonStringify, 0);
+  sq_setparamscheck(v, 2, "..");
+  sq_setnativeclosurename(v, -1, "stringify");
+  sq_newslot(v, -3, SQFalse);
+
+  return sq_newslot(v, -3, SQFalse);
+}
+
+}
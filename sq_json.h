@@ -0,0 +1,13 @@
+#pragma once
+
+#include "squirrel.h"
+
+namespace sq {
+
+// Registers the json table into the table on top of the stack:
+//   json.parse(string) - builds arrays and tables straight on the VM stack
+//   json.stringify(value) - compact JSON, see VM::toString
+// Integers without fraction or exponent stay integers, the rest are floats.
+SQRESULT registerJsonLib(HSQUIRRELVM v);
+
+}
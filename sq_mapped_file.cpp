@@ -0,0 +1,93 @@
+#include "sq_mapped_file.h"
+
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SQVM_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sq {
+
+MappedFile::MappedFile(MappedFile&& other) {
+  *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator = (MappedFile&& other) {
+  if (this == &other) return *this;
+  close();
+  buffer = std::move(other.buffer);
+  ptr = !other.opened? nullptr: other.mapped? other.ptr: &buffer[0];
+  length = other.length;
+  mapped = other.mapped;
+  opened = other.opened;
+  other.ptr = nullptr;
+  other.length = 0;
+  other.mapped = false;
+  other.opened = false;
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+bool MappedFile::open(const std::string& fileName, bool writable) {
+  close();
+#ifdef SQVM_HAVE_MMAP
+  const int fd = ::open(fileName.c_str(), writable? O_RDWR: O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if ((::fstat(fd, &info) != 0) || !S_ISREG(info.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+  length = info.st_size;
+  // Empty files can't be mapped
+  if (length > 0) {
+    void* data = ::mmap(nullptr, length, PROT_READ | (writable? PROT_WRITE: 0),
+                        writable? MAP_SHARED: MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd);
+      length = 0;
+      return false;
+    }
+    ptr = reinterpret_cast<char*>(data);
+    mapped = true;
+  } else {
+    ptr = &buffer[0];
+  }
+  ::close(fd);
+#else
+  // Stores to the buffer would never reach the file
+  if (writable) return false;
+  std::ifstream file(fileName, std::ios::binary);
+  if (!file) return false;
+  std::ostringstream data;
+  data << file.rdbuf();
+  if (file.bad()) return false;
+  buffer = data.str();
+  ptr = &buffer[0];
+  length = buffer.size();
+#endif
+  opened = true;
+  return true;
+}
+
+void MappedFile::close() {
+#ifdef SQVM_HAVE_MMAP
+  if (mapped) ::munmap(ptr, length);
+#endif
+  buffer.clear();
+  ptr = nullptr;
+  length = 0;
+  mapped = false;
+  opened = false;
+}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace sq {
+
+// Whole file mapped into memory (read into a buffer where mmap isn't
+// available). Writable mappings are shared, so stores reach the file.
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&& other);
+  MappedFile& operator = (MappedFile&& other);
+  ~MappedFile();
+
+  bool open(const std::string& fileName, bool writable = false);
+  void close();
+
+  inline bool isOpen() const { return opened; }
+  inline char* data() { return ptr; }
+  inline const char* data() const { return ptr; }
+  inline size_t size() const { return length; }
+
+private:
+  char* ptr = nullptr;
+  size_t length = 0;
+  bool mapped = false;
+  bool opened = false;
+  std::string buffer;
+};
+
+}
@@ -0,0 +1,152 @@
+#include "sq_metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ostream>
+
+namespace sq {
+
+namespace {
+
+const std::memory_order relaxed = std::memory_order_relaxed;
+
+size_t bucketOf(std::chrono::nanoseconds duration) {
+  const std::uint64_t us = (std::max<std::int64_t>(duration.count(), 0) + 999) / 1000;
+  if (us <= 1) return 0;
+  // ceil(log2(us))
+#if defined(__GNUC__)
+  const size_t bucket = 64 - __builtin_clzll(us - 1);
+#else
+  size_t bucket = 0;
+  while ((std::uint64_t(1) << bucket) < us) ++bucket;
+#endif
+  return std::min(bucket, Metrics::BUCKETS - 1);
+}
+
+// Counters stay exact up to 2^53
+std::string formatNumber(double value) {
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.15g", value);
+  return text;
+}
+
+}
+
+void Metrics::record(Op op, std::chrono::nanoseconds duration, bool failed) {
+  Counters& counters = ops[op];
+  counters.count.fetch_add(1, relaxed);
+  if (failed) counters.failed.fetch_add(1, relaxed);
+  counters.totalNs.fetch_add(std::max<std::int64_t>(duration.count(), 0), relaxed);
+  counters.buckets[bucketOf(duration)].fetch_add(1, relaxed);
+}
+
+void Metrics::recordError() {
+  errors.fetch_add(1, relaxed);
+}
+
+void Metrics::recordStackTop(std::int64_t top) {
+  std::int64_t current = maxStackTop.load(relaxed);
+  while ((top > current) && !maxStackTop.compare_exchange_weak(current, top, relaxed)) {}
+}
+
+void Metrics::reset() {
+  for (Counters& counters: ops) {
+    counters.count.store(0, relaxed);
+    counters.failed.store(0, relaxed);
+    counters.totalNs.store(0, relaxed);
+    for (std::atomic<std::uint64_t>& bucket: counters.buckets)
+      bucket.store(0, relaxed);
+  }
+  errors.store(0, relaxed);
+  maxStackTop.store(0, relaxed);
+}
+
+Metrics::Snapshot Metrics::snapshot() const {
+  Snapshot result;
+  for (size_t op = 0; op < OP_COUNT; ++op) {
+    const Counters& counters = ops[op];
+    OpStats& stats = result.ops[op];
+    stats.count = counters.count.load(relaxed);
+    stats.failed = counters.failed.load(relaxed);
+    stats.totalNs = counters.totalNs.load(relaxed);
+    for (size_t i = 0; i < BUCKETS; ++i)
+      stats.buckets[i] = counters.buckets[i].load(relaxed);
+  }
+  result.errors = errors.load(relaxed);
+  result.maxStackTop = maxStackTop.load(relaxed);
+  return result;
+}
+
+// Samples come grouped by family as the exposition format wants them
+void Metrics::visit(const std::function<void(const Sample& sample)>& callback,
+                    const std::string& prefix) const {
+  const Snapshot data = snapshot();
+  std::string labels[OP_COUNT];
+  for (size_t op = 0; op < OP_COUNT; ++op)
+    labels[op] = std::string("op=\"") + opName(Op(op)) + '"';
+
+  for (size_t op = 0; op < OP_COUNT; ++op)
+    callback(Sample{prefix + "_operations_total", labels[op], double(data.ops[op].count)});
+  for (size_t op = 0; op < OP_COUNT; ++op)
+    callback(Sample{prefix + "_operation_failures_total", labels[op], double(data.ops[op].failed)});
+  for (size_t op = 0; op < OP_COUNT; ++op) {
+    const OpStats& stats = data.ops[op];
+    std::uint64_t cumulative = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      cumulative += stats.buckets[i];
+      const std::string le = (i + 1 < BUCKETS)? formatNumber(bucketBound(i)): "+Inf";
+      callback(Sample{prefix + "_operation_duration_seconds_bucket",
+                      labels[op] + ",le=\"" + le + '"', double(cumulative)});
+    }
+    callback(Sample{prefix + "_operation_duration_seconds_sum", labels[op], stats.totalNs * 1e-9});
+    callback(Sample{prefix + "_operation_duration_seconds_count", labels[op], double(stats.count)});
+  }
+  callback(Sample{prefix + "_errors_total", std::string(), double(data.errors)});
+  callback(Sample{prefix + "_stack_top_max", std::string(), double(data.maxStackTop)});
+}
+
+void Metrics::writePrometheus(std::ostream& out, const std::string& prefix) const {
+  struct Family {
+    const char* name;
+    const char* type;
+    const char* help;
+  };
+  static const Family families[] = {
+    {"_operations_total", "counter", "VM operations"},
+    {"_operation_failures_total", "counter", "VM operations ended by an exception"},
+    {"_operation_duration_seconds", "histogram", "VM operation latency"},
+    {"_errors_total", "counter", "VM errors raised"},
+    {"_stack_top_max", "gauge", "Highest VM stack top seen"}
+  };
+  const Family* current = nullptr;
+  visit([&](const Sample& sample) {
+    for (const Family& family: families) {
+      const std::string name = prefix + family.name;
+      if ((&family == current) || (sample.name.compare(0, name.size(), name) != 0)) continue;
+      current = &family;
+      out << "# HELP " << name << ' ' << family.help << '\n'
+          << "# TYPE " << name << ' ' << family.type << '\n';
+      break;
+    }
+    out << sample.name;
+    if (!sample.labels.empty()) out << '{' << sample.labels << '}';
+    out << ' ' << formatNumber(sample.value) << '\n';
+  }, prefix);
+}
+
+const char* Metrics::opName(Op op) {
+  switch (op) {
+  case CALL:        return "call";
+  case COMPILE:     return "compile";
+  case EXEC:        return "exec";
+  case DO_FILE:     return "do_file";
+  case NATIVE_CALL: return "native_call";
+  default:          return "unknown";
+  }
+}
+
+double Metrics::bucketBound(size_t bucket) {
+  return double(std::uint64_t(1) << bucket) * 1e-6;
+}
+
+}
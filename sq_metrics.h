@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+
+namespace sq {
+
+// Counters and latency histograms for VM operations. VMs record into the
+// Metrics their metrics pointer names only when built with SQVM_METRICS,
+// otherwise the instrumentation compiles away. One Metrics may be shared
+// by VMs on several threads, counters are relaxed atomics.
+// An operation counts as failed unless it reaches its success point, so
+// exceptions and native closures returning an error count as failures.
+// exec and doFile are recorded along with the compile and call they
+// consist of.
+// The stack high-water mark is the API stack top seen by instrumented
+// operations, not the script's internal stack.
+class Metrics {
+public:
+  enum Op {
+    CALL,
+    COMPILE,
+    EXEC,
+    DO_FILE,
+    NATIVE_CALL,
+    OP_COUNT
+  };
+
+  // Upper bounds are 1us * 2^i, the last bucket is +Inf
+  static const size_t BUCKETS = 25;
+
+  struct OpStats {
+    std::uint64_t count = 0;
+    std::uint64_t failed = 0;
+    std::uint64_t totalNs = 0;
+    std::array<std::uint64_t, BUCKETS> buckets{};  // not cumulative
+  };
+
+  struct Snapshot {
+    std::array<OpStats, OP_COUNT> ops;
+    std::uint64_t errors = 0;  // VM::Error exceptions created
+    std::int64_t maxStackTop = 0;
+  };
+
+  // One exported value: name, Prometheus label list (may be empty), value
+  struct Sample {
+    std::string name;
+    std::string labels;
+    double value;
+  };
+
+  class Scope;
+
+  Metrics() = default;
+  Metrics(const Metrics&) = delete;
+
+  void record(Op op, std::chrono::nanoseconds duration, bool failed);
+  void recordError();
+  void recordStackTop(std::int64_t top);
+  void reset();
+
+  Snapshot snapshot() const;
+  void visit(const std::function<void(const Sample& sample)>& callback,
+             const std::string& prefix = "squirrel") const;
+  // Text exposition format
+  void writePrometheus(std::ostream& out, const std::string& prefix = "squirrel") const;
+
+  static const char* opName(Op op);
+  static double bucketBound(size_t bucket);
+
+private:
+  struct Counters {
+    std::atomic<std::uint64_t> count{0};
+    std::atomic<std::uint64_t> failed{0};
+    std::atomic<std::uint64_t> totalNs{0};
+    std::array<std::atomic<std::uint64_t>, BUCKETS> buckets{};
+  };
+
+  std::array<Counters, OP_COUNT> ops;
+  std::atomic<std::uint64_t> errors{0};
+  std::atomic<std::int64_t> maxStackTop{0};
+};
+
+// Times an operation, a null Metrics records nothing. The operation is
+// recorded as failed unless succeeded() is called before the scope ends.
+class Metrics::Scope {
+public:
+  Scope(Metrics* metrics, Op op)
+      : metrics(metrics), op(op),
+        start(metrics? std::chrono::steady_clock::now(): std::chrono::steady_clock::time_point()) {}
+  Scope(const Scope&) = delete;
+
+  ~Scope() {
+    if (metrics)
+      metrics->record(op, std::chrono::steady_clock::now() - start, failed);
+  }
+
+  inline void succeeded() { failed = false; }
+
+  // Native closure results, negative ones (SQ_ERROR) are failures
+  template <typename R>
+  inline R result(R value) {
+    failed = (value < 0);
+    return value;
+  }
+
+private:
+  Metrics* metrics;
+  Op op;
+  std::chrono::steady_clock::time_point start;
+  bool failed = true;
+};
+
+}
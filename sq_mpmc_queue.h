@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace sq {
+
+// Bounded lock-free multi-producer multi-consumer queue (D. Vyukov's
+// algorithm): every cell carries a sequence number telling whether it is
+// ready for the next push or pop, so producers and consumers only contend
+// on their own position counter.
+template <typename T>
+class MPMCQueue {
+public:
+  // Capacity is rounded up to a power of two
+  explicit MPMCQueue(size_t capacity);
+  MPMCQueue(const MPMCQueue&) = delete;
+
+  // Both return false instead of blocking when the queue is full / empty
+  bool push(T&& value);
+  bool pop(T& value);
+
+  inline size_t capacity() const { return mask + 1; }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  static const size_t CACHE_LINE = 64;
+
+  std::unique_ptr<Cell[]> buffer;
+  size_t mask;
+  char pad0[CACHE_LINE];
+  std::atomic<size_t> enqueuePos;
+  char pad1[CACHE_LINE];
+  std::atomic<size_t> dequeuePos;
+  char pad2[CACHE_LINE];
+};
+
+template <typename T>
+MPMCQueue<T>::MPMCQueue(size_t capacity): enqueuePos(0), dequeuePos(0) {
+  size_t size = 2;
+  while (size < capacity) size *= 2;
+  buffer.reset(new Cell[size]);
+  mask = size - 1;
+  for (size_t i = 0; i < size; ++i)
+    buffer[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template <typename T>
+bool MPMCQueue<T>::push(T&& value) {
+  Cell* cell;
+  size_t pos = enqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    cell = &buffer[pos & mask];
+    const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+  cell->data = std::move(value);
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool MPMCQueue<T>::pop(T& value) {
+  Cell* cell;
+  size_t pos = dequeuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    cell = &buffer[pos & mask];
+    const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = dequeuePos.load(std::memory_order_relaxed);
+    }
+  }
+  value = std::move(cell->data);
+  cell->data = T();
+  cell->sequence.store(pos + mask + 1, std::memory_order_release);
+  return true;
+}
+
+}
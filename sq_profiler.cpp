@@ -0,0 +1,262 @@
+#include "sq_profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace sq {
+
+namespace {
+
+inline uint64_t nanoseconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+}
+
+size_t Profiler::KeyHash::operator () (const Key& key) const {
+  size_t h = std::hash<const void*>()(key.source);
+  h = h * 31 + std::hash<const void*>()(key.name);
+  return h * 31 + std::hash<SQInteger>()(key.line);
+}
+
+Profiler::Profiler(Mode mode, std::chrono::microseconds interval)
+    : mode(mode), interval(interval), sampling(false), sampleDue(false) {
+  reset();
+}
+
+Profiler::~Profiler() {
+  detach();
+}
+
+void Profiler::attach(VM* v) {
+  detach();
+  vm = v;
+  lastEvent = Clock::now();
+  vm->setDebugHandler(this);
+  if (mode == SAMPLING) {
+    sampling = true;
+    sampler = std::thread([this] {
+      while (sampling.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(this->interval);
+        sampleDue.store(true, std::memory_order_relaxed);
+      }
+    });
+  }
+}
+
+void Profiler::detach() {
+  // The VM is only used while the profiler is its handler, see
+  // onSqDebugDetached()
+  VM* attached = vm;
+  onSqDebugDetached(vm);
+  if (attached) attached->setDebugHandler(nullptr);
+}
+
+void Profiler::onSqDebugDetached(VM* v) {
+  if (v != vm) return;
+  stopSampler();
+  vm = nullptr;
+  // Frames still open when detached never return
+  for (Function& function: functions)
+    function.active = 0;
+  stack.clear();
+  currentLine = nullptr;
+}
+
+void Profiler::stopSampler() {
+  if (!sampler.joinable()) return;
+  sampling = false;
+  sampler.join();
+  sampleDue = false;
+}
+
+void Profiler::reset() {
+  functions.clear();
+  functionIds.clear();
+  lines.clear();
+  nodes.clear();
+  stack.clear();
+  currentLine = nullptr;
+  samples = 0;
+  Node root;
+  root.function = -1;
+  root.parent = -1;
+  nodes.push_back(root);
+}
+
+void Profiler::onSqDebugEvent(
+                 VM* v,
+                 SQInteger type,
+                 const SQChar* source,
+                 SQInteger line,
+                 const SQChar* function) {
+  Clock::time_point now;
+  if (mode == EXACT) {
+    now = Clock::now();
+    if (currentLine) currentLine->time += nanoseconds(now - lastEvent);
+    lastEvent = now;
+  }
+
+  switch (type) {
+  case 'c':
+    enter(source, line, function, now);
+    break;
+  case 'r':
+    leave(now);
+    break;
+  case 'l':
+    step(source, line);
+    break;
+  }
+
+  if ((mode == SAMPLING) && sampleDue.load(std::memory_order_relaxed)) {
+    sampleDue.store(false, std::memory_order_relaxed);
+    sample();
+  }
+}
+
+void Profiler::enter(const SQChar* source, SQInteger line, const SQChar* function, Clock::time_point now) {
+  // Source and function names are interned squirrel strings, their
+  // addresses identify the function together with its first line
+  const Key key = {source, function, line};
+  auto found = functionIds.find(key);
+  int id;
+  if (found == functionIds.end()) {
+    id = static_cast<int>(functions.size());
+    functions.push_back(Function());
+    functions.back().name = std::string(function? function: "<anonymous>") + " " +
+                            (source? source: "?") + ":" + std::to_string(line);
+    functionIds.emplace(key, id);
+  } else {
+    id = found->second;
+  }
+
+  Function& f = functions[id];
+  ++f.calls;
+  ++f.active;
+
+  const int parent = stack.empty()? 0: stack.back().node;
+  auto child = nodes[parent].children.find(id);
+  int node;
+  if (child == nodes[parent].children.end()) {
+    node = static_cast<int>(nodes.size());
+    nodes[parent].children.emplace(id, node);
+    Node n;
+    n.function = id;
+    n.parent = parent;
+    nodes.push_back(std::move(n));
+  } else {
+    node = child->second;
+  }
+
+  const Frame frame = {id, node, now, 0, currentLine};
+  stack.push_back(frame);
+  currentLine = nullptr;
+}
+
+void Profiler::leave(Clock::time_point now) {
+  // Returns from calls entered before attaching
+  if (stack.empty()) return;
+  const Frame frame = stack.back();
+  stack.pop_back();
+  currentLine = frame.callerLine;
+
+  Function& f = functions[frame.function];
+  --f.active;
+  if (mode != EXACT) return;
+
+  const uint64_t elapsed = nanoseconds(now - frame.start);
+  const uint64_t self = (elapsed > frame.children)? elapsed - frame.children: 0;
+  f.exclusive += self;
+  nodes[frame.node].self += self;
+  if (f.active == 0) f.inclusive += elapsed;
+  if (!stack.empty()) stack.back().children += elapsed;
+}
+
+void Profiler::step(const SQChar* source, SQInteger line) {
+  const Key key = {source, nullptr, line};
+  auto found = lines.find(key);
+  if (found == lines.end()) {
+    found = lines.emplace(key, Line()).first;
+    found->second.source = source? source: "?";
+    found->second.line = line;
+  }
+  currentLine = &found->second;
+  ++currentLine->hits;
+}
+
+void Profiler::sample() {
+  // Samples outside of script code are dropped
+  if (stack.empty()) return;
+  ++samples;
+  ++nodes[stack.back().node].self;
+  ++functions[stack.back().function].exclusive;
+  for (const Frame& frame: stack) {
+    Function& f = functions[frame.function];
+    if (f.lastSample == samples) continue;
+    f.lastSample = samples;
+    ++f.inclusive;
+  }
+  if (currentLine) ++currentLine->time;
+}
+
+uint64_t Profiler::total() const {
+  uint64_t result = 0;
+  for (const Function& function: functions)
+    result += function.exclusive;
+  return result;
+}
+
+void Profiler::writeFolded(std::ostream& out) const {
+  std::vector<int> path;
+  for (const Node& node: nodes) {
+    const uint64_t value = (mode == EXACT)? node.self / 1000: node.self;
+    if ((node.function < 0) || (value == 0)) continue;
+    path.clear();
+    for (const Node* n = &node; n->function >= 0; n = &nodes[n->parent])
+      path.push_back(n->function);
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      if (it != path.rbegin()) out << ';';
+      out << functions[*it].name;
+    }
+    out << ' ' << value << '\n';
+  }
+}
+
+void Profiler::writeSummary(std::ostream& out, size_t limit) const {
+  // Nanoseconds are shown as microseconds, samples as they are
+  const uint64_t unit = (mode == EXACT)? 1000: 1;
+  const char* unitName = (mode == EXACT)? "us": "samples";
+
+  std::vector<const Function*> byTime;
+  for (const Function& function: functions)
+    byTime.push_back(&function);
+  std::sort(byTime.begin(), byTime.end(), [](const Function* a, const Function* b) {
+    return a->exclusive > b->exclusive;
+  });
+  if (byTime.size() > limit) byTime.resize(limit);
+
+  out << "Profile (" << ((mode == EXACT)? "exact": "sampling") << "), "
+      << functions.size() << " functions, " << total() / unit << ' ' << unitName << '\n';
+  out << std::setw(10) << "calls" << std::setw(14) << "inclusive" << std::setw(14) << "exclusive"
+      << "  function\n";
+  for (const Function* f: byTime)
+    out << std::setw(10) << f->calls << std::setw(14) << f->inclusive / unit
+        << std::setw(14) << f->exclusive / unit << "  " << f->name << '\n';
+
+  std::vector<const Line*> hotLines;
+  for (auto& line: lines)
+    hotLines.push_back(&line.second);
+  std::sort(hotLines.begin(), hotLines.end(), [](const Line* a, const Line* b) {
+    return (a->time != b->time)? a->time > b->time: a->hits > b->hits;
+  });
+  if (hotLines.size() > limit) hotLines.resize(limit);
+
+  out << std::setw(10) << "hits" << std::setw(14) << unitName << "  line\n";
+  for (const Line* line: hotLines)
+    out << std::setw(10) << line->hits << std::setw(14) << line->time / unit
+        << "  " << line->source << ':' << line->line << '\n';
+}
+
+}
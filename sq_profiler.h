@@ -0,0 +1,128 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sq {
+
+// Script profiler on the native debug hook (needs the debug info VM enables).
+// The hook runs for every call, return and line event in both modes.
+// EXACT reads the clock on each of them and reports microseconds. SAMPLING
+// skips the clock and keeps only a shadow call stack, a background thread
+// marks a sample due every interval and the next event records the stack,
+// so it reports sample counts.
+// Destroying the VM or installing another handler detaches the profiler.
+// Inclusive time of recursive functions is counted once, for the outermost
+// call. Hook events come from the VM thread only, attach the profiler to the
+// VM running the scripts.
+class Profiler: public VM::DebugHandler {
+public:
+  enum Mode {
+    EXACT,
+    SAMPLING
+  };
+
+  explicit Profiler(
+             Mode mode = EXACT,
+             std::chrono::microseconds interval = std::chrono::microseconds(1000));
+  Profiler(const Profiler&) = delete;
+  ~Profiler();
+
+  void attach(VM* vm);
+  void detach();
+  void reset();
+
+  inline Mode getMode() const { return mode; }
+  inline bool isAttached() const { return vm != nullptr; }
+
+  // Flamegraph input, one "outer;inner value" line per stack
+  void writeFolded(std::ostream& out) const;
+  // Functions by exclusive time, then the hottest lines
+  void writeSummary(std::ostream& out, size_t limit = 20) const;
+
+  void onSqDebugEvent(
+         VM* vm,
+         SQInteger type,
+         const SQChar* source,
+         SQInteger line,
+         const SQChar* function) override;
+  void onSqDebugDetached(VM* vm) override;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Key {
+    const void* source;
+    const void* name;
+    SQInteger line;
+
+    inline bool operator == (const Key& other) const {
+      return (source == other.source) && (name == other.name) && (line == other.line);
+    }
+  };
+  struct KeyHash {
+    size_t operator () (const Key& key) const;
+  };
+
+  struct Function {
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t inclusive = 0;
+    uint64_t exclusive = 0;
+    int active = 0;
+    uint64_t lastSample = 0;
+  };
+  struct Line {
+    std::string source;
+    SQInteger line = 0;
+    uint64_t hits = 0;
+    uint64_t time = 0;
+  };
+  // Call tree node, the folded stacks are the paths to the root
+  struct Node {
+    int function;
+    int parent;
+    uint64_t self = 0;
+    std::unordered_map<int, int> children;
+  };
+  struct Frame {
+    int function;
+    int node;
+    Clock::time_point start;
+    uint64_t children;
+    Line* callerLine;
+  };
+
+  void enter(const SQChar* source, SQInteger line, const SQChar* function, Clock::time_point now);
+  void leave(Clock::time_point now);
+  void step(const SQChar* source, SQInteger line);
+  void sample();
+  void stopSampler();
+  uint64_t total() const;
+
+  Mode mode;
+  std::chrono::microseconds interval;
+  VM* vm = nullptr;
+
+  std::vector<Function> functions;
+  std::unordered_map<Key, int, KeyHash> functionIds;
+  std::unordered_map<Key, Line, KeyHash> lines;
+  std::vector<Node> nodes;
+  std::vector<Frame> stack;
+  Line* currentLine = nullptr;
+  Clock::time_point lastEvent;
+  uint64_t samples = 0;
+
+  std::thread sampler;
+  std::atomic<bool> sampling;
+  std::atomic<bool> sampleDue;
+};
+
+}
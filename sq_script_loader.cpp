@@ -0,0 +1,208 @@
+#include "sq_script_loader.h"
+#include "sq_mapped_file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+namespace sq {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+inline std::chrono::microseconds since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+}
+
+// Keeps the last compiler report for the error message
+class CompileLog: public VM::PrintHandler {
+public:
+  void onSqPrintData(VM* vm, const char* data, size_t size) override {}
+  void onSqErrorData(VM* vm, const char* data, size_t size) override {}
+  void onSqCompileError(
+         VM* vm,
+         const std::string& desc,
+         const std::string& source,
+         SQInteger line,
+         SQInteger column) override {
+    last = desc + " in " + source + " on line " + std::to_string(line) +
+           " column " + std::to_string(column);
+  }
+
+  std::string last;
+};
+
+void compileScript(
+       VM& vm,
+       CompileLog& log,
+       const std::string& fileName,
+       ScriptLoader::Script& script,
+       std::string& error) {
+  const Clock::time_point start = Clock::now();
+  script.stats.fileName = fileName;
+  MappedFile file;
+  if (!file.open(fileName)) {
+    error = "Can't read file";
+    return;
+  }
+  const char* data = file.data();
+  size_t size = file.size();
+  script.stats.bytes = size;
+
+  unsigned short tag = 0;
+  if (size >= sizeof(tag)) std::memcpy(&tag, data, sizeof(tag));
+  if (tag == SQ_BYTECODE_STREAM_TAG) {
+    script.stats.bytecode = true;
+    script.bytecode.assign(data, size);
+  } else {
+    // Skip UTF-8 BOM
+    if ((size >= 3) && (std::memcmp(data, "\xEF\xBB\xBF", 3) == 0)) {
+      data += 3;
+      size -= 3;
+    }
+    const int top = vm.getTop();
+    try {
+      log.last.clear();
+      vm.compile(data, size, fileName);
+      script.bytecode = vm.writeClosure();
+      vm.pop();
+    } catch (std::exception& e) {
+      error = log.last.empty()? e.what(): log.last;
+      vm.setTop(top);
+      return;
+    }
+  }
+  script.stats.compileTime = since(start);
+}
+
+std::string directoryOf(const std::string& fileName) {
+  const size_t slash = fileName.find_last_of('/');
+  return (slash == std::string::npos)? std::string(): fileName.substr(0, slash + 1);
+}
+
+}
+
+ScriptLoader::ScriptLoader(size_t threads): threads(threads) {
+}
+
+void ScriptLoader::addFile(const std::string& fileName) {
+  fileNames.push_back(fileName);
+}
+
+void ScriptLoader::addDirectory(const std::string& dir, const std::string& extension) {
+#if defined(__unix__) || defined(__APPLE__)
+  DIR* handle = ::opendir(dir.c_str());
+  if (!handle)
+    throw VM::Error(nullptr, 0, "Can't open directory " + dir);
+  std::vector<std::string> found;
+  const std::string prefix = (!dir.empty() && (dir.back() != '/'))? dir + '/': dir;
+  while (dirent* entry = ::readdir(handle)) {
+    const std::string name = entry->d_name;
+    if ((name.size() <= extension.size()) ||
+        (name.compare(name.size() - extension.size(), extension.size(), extension) != 0))
+      continue;
+    struct stat info;
+    if ((::stat((prefix + name).c_str(), &info) == 0) && S_ISREG(info.st_mode))
+      found.push_back(prefix + name);
+  }
+  ::closedir(handle);
+  std::sort(found.begin(), found.end());
+  fileNames.insert(fileNames.end(), found.begin(), found.end());
+#else
+  throw VM::Error(nullptr, 0, VM::Error::Static("Directory loading is not supported on this platform"));
+#endif
+}
+
+void ScriptLoader::addManifest(const std::string& fileName) {
+  std::ifstream manifest(fileName);
+  if (!manifest)
+    throw VM::Error(nullptr, 0, "Can't read manifest " + fileName);
+  const std::string base = directoryOf(fileName);
+  std::string line;
+  while (std::getline(manifest, line)) {
+    const size_t first = line.find_first_not_of(" \t\r");
+    if ((first == std::string::npos) || (line[first] == '#')) continue;
+    const size_t last = line.find_last_not_of(" \t\r");
+    const std::string path = line.substr(first, last - first + 1);
+    fileNames.push_back((path[0] == '/')? path: base + path);
+  }
+}
+
+std::vector<ScriptLoader::Script> ScriptLoader::compile() const {
+  std::vector<Script> scripts(fileNames.size());
+  std::vector<std::string> errors(fileNames.size());
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    CompileLog log;
+    std::unique_ptr<VM> vm;
+    for (size_t i = next++; i < fileNames.size(); i = next++) {
+      try {
+        if (!vm) {
+          vm.reset(new VM(&log));
+          vm->setCompileCacheLimit(0);
+        }
+      } catch (std::exception& e) {
+        errors[i] = e.what();
+        continue;
+      }
+      compileScript(*vm, log, fileNames[i], scripts[i], errors[i]);
+    }
+  };
+
+  size_t count = threads? threads: std::max(1u, std::thread::hardware_concurrency());
+  count = std::min(count, fileNames.size());
+  // This thread is one of the workers
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < count; ++i)
+    workers.emplace_back(worker);
+  worker();
+  for (std::thread& thread: workers)
+    thread.join();
+
+  for (size_t i = 0; i < errors.size(); ++i) {
+    if (!errors[i].empty())
+      throw VM::Error(nullptr, 0, fileNames[i] + ": " + errors[i]);
+  }
+  return scripts;
+}
+
+std::vector<ScriptLoader::Stats> ScriptLoader::load(VM& vm, bool run) const {
+  std::vector<Script> scripts = compile();
+  std::vector<Stats> result;
+  result.reserve(scripts.size());
+  for (Script& script: scripts) {
+    load(vm, script, run);
+    result.push_back(std::move(script.stats));
+  }
+  return result;
+}
+
+void ScriptLoader::load(VM& vm, Script& script, bool run) {
+  const int top = vm.getTop();
+  Clock::time_point start = Clock::now();
+  try {
+    vm.readClosure(script.bytecode);
+    script.stats.loadTime = since(start);
+    if (!run) return;
+    start = Clock::now();
+    vm.pushRootTable();
+    vm.call(1, false);
+    script.stats.runTime = since(start);
+  } catch (std::exception& e) {
+    vm.setTop(top);
+    throw VM::Error(&vm, 0, script.stats.fileName + ": " + e.what());
+  }
+  vm.setTop(top);
+}
+
+}
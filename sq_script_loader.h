@@ -0,0 +1,58 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace sq {
+
+// Bulk script loading. Files are mapped and compiled in parallel on worker
+// VMs, the closures are moved to the target VM as bytecode and run there in
+// the order they were added. Bytecode files are taken as they are.
+//
+// Usage:
+//   ScriptLoader loader;
+//   loader.addManifest("scripts/manifest.txt");
+//   for (auto& stats: loader.load(vm)) ...
+class ScriptLoader {
+public:
+  struct Stats {
+    std::string fileName;
+    size_t bytes = 0;
+    bool bytecode = false;
+    std::chrono::microseconds compileTime{0};  // map, compile and serialize
+    std::chrono::microseconds loadTime{0};     // read the bytecode
+    std::chrono::microseconds runTime{0};
+  };
+
+  struct Script {
+    std::string bytecode;
+    Stats stats;
+  };
+
+  // 0 threads - one per hardware thread
+  explicit ScriptLoader(size_t threads = 0);
+
+  void addFile(const std::string& fileName);
+  // Files with the extension, sorted by name, subdirectories are skipped
+  void addDirectory(const std::string& dir, const std::string& extension = ".nut");
+  // One path per line relative to the manifest, # starts a comment line
+  void addManifest(const std::string& fileName);
+
+  inline const std::vector<std::string>& files() const { return fileNames; }
+
+  // Throws VM::Error naming the first file (in order) that failed
+  std::vector<Script> compile() const;
+  // Compiles, then loads and runs (unless run is false) in vm, the
+  // closures are left on the stack when not run
+  std::vector<Stats> load(VM& vm, bool run = true) const;
+  static void load(VM& vm, Script& script, bool run = true);
+
+private:
+  size_t threads;
+  std::vector<std::string> fileNames;
+};
+
+}
@@ -0,0 +1,586 @@
+#include "sq_snapshot.h"
+
+#include <cstring>
+#include <fstream>
+
+namespace sq {
+
+namespace {
+
+const char MAGIC[] = {'S', 'Q', 'S', 'N', 'A', 'P'};
+const unsigned char VERSION = 2;
+const int MAX_DEPTH = 1000;
+
+enum Tag: unsigned char {
+  T_NULL,
+  T_INTEGER,
+  T_FLOAT,
+  T_TRUE,
+  T_FALSE,
+  T_STRING,
+  T_ARRAY,
+  T_TABLE,
+  T_CLOSURE,
+  T_ROOT,  // value of the root slot named by the string that follows
+  T_REF    // container or closure written before, by index
+};
+
+inline bool isScalar(SQObjectType type) {
+  return (type == OT_NULL) || (type == OT_INTEGER) || (type == OT_FLOAT) ||
+         (type == OT_BOOL) || (type == OT_STRING);
+}
+
+void appendVarint(std::string& out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out += char((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out += char(value);
+}
+
+inline bool sameObject(const HSQOBJECT& a, const HSQOBJECT& b) {
+  return (a._type == b._type) && (a._unVal.raw == b._unVal.raw);
+}
+
+// Pushes a table with the slots of the table or class on top
+void copySlots(HSQUIRRELVM v) {
+  sq_newtable(v);
+  sq_pushnull(v);
+  while (SQ_SUCCEEDED(sq_next(v, -3)))
+    sq_newslot(v, -4, SQFalse);
+  sq_pop(v, 1);
+}
+
+class Encoder {
+public:
+  Encoder(VM& vm, const std::unordered_map<const void*, std::string>& baselineKeys,
+          std::vector<std::string>& skipped)
+      : vm(vm), v(vm.handle()), baselineKeys(baselineKeys), skipped(skipped) {}
+
+  std::string out;
+
+  inline void varint(std::uint64_t value) { appendVarint(out, value); }
+
+  void text(const SQChar* str, size_t size) {
+    varint(size);
+    out.append(reinterpret_cast<const char*>(str), size * sizeof(SQChar));
+  }
+
+  // Value on top, the stack is left as it was. Returns false with the
+  // reason when the value can't be stored; nothing is written then.
+  bool value(const std::string& path, int depth, const char*& reason) {
+    HSQOBJECT obj;
+    sq_getstackobj(v, -1, &obj);
+    const SQObjectType type = obj._type;
+    if (isScalar(type)) {
+      scalar(obj);
+      return true;
+    }
+
+    auto root = baselineKeys.find(obj._unVal.pRefCounted);
+    if (root != baselineKeys.end()) {
+      out += char(T_ROOT);
+      text(root->second.data(), root->second.size());
+      return true;
+    }
+    auto seen = refs.find(obj._unVal.pRefCounted);
+    if (seen != refs.end()) {
+      out += char(T_REF);
+      varint(seen->second);
+      return true;
+    }
+    if (depth >= MAX_DEPTH) {
+      reason = "nested too deep";
+      return false;
+    }
+
+    switch (type) {
+    case OT_ARRAY: {
+      refs.emplace(obj._unVal.pRefCounted, refs.size());
+      const SQInteger size = sq_getsize(v, -1);
+      out += char(T_ARRAY);
+      varint(size);
+      for (SQInteger i = 0; i < size; ++i) {
+        sq_pushinteger(v, i);
+        sq_rawget(v, -2);
+        nested(path + '[' + std::to_string(i) + ']', depth);
+        sq_pop(v, 1);
+      }
+      return true;
+    }
+    case OT_TABLE: {
+      refs.emplace(obj._unVal.pRefCounted, refs.size());
+      // Pairs with keys that can't be stored are left out
+      SQInteger count = 0;
+      sq_pushnull(v);
+      while (SQ_SUCCEEDED(sq_next(v, -2))) {
+        if (isScalar(sq_gettype(v, -2))) ++count;
+        else skipped.push_back(path + ": key of type " + vm.valueTypeName(-2));
+        sq_pop(v, 2);
+      }
+      sq_pop(v, 1);
+      out += char(T_TABLE);
+      varint(count);
+      sq_pushnull(v);
+      while (SQ_SUCCEEDED(sq_next(v, -2))) {
+        if (isScalar(sq_gettype(v, -2))) {
+          HSQOBJECT key;
+          sq_getstackobj(v, -2, &key);
+          scalar(key);
+          nested(path + '.' + keyName(-2), depth);
+        }
+        sq_pop(v, 2);
+      }
+      sq_pop(v, 1);
+      return true;
+    }
+    case OT_CLOSURE: {
+      std::string bytecode;
+      try {
+        bytecode = vm.writeClosure();
+      } catch (VM::Error&) {
+        reason = "closure can't be serialized (free variables?)";
+        return false;
+      }
+      refs.emplace(obj._unVal.pRefCounted, refs.size());
+      out += char(T_CLOSURE);
+      varint(bytecode.size());
+      out += bytecode;
+      return true;
+    }
+    case OT_NATIVECLOSURE:
+      reason = "native closure not in the root table";
+      return false;
+    default:
+      reason = VM::typeName(type);
+      return false;
+    }
+  }
+
+private:
+  void scalar(const HSQOBJECT& obj) {
+    switch (obj._type) {
+    case OT_INTEGER: {
+      // zigzag
+      const std::int64_t value = sq_objtointeger(&obj);
+      out += char(T_INTEGER);
+      varint((std::uint64_t(value) << 1) ^ std::uint64_t(value >> 63));
+      break;
+    }
+    case OT_FLOAT: {
+      const SQFloat value = sq_objtofloat(&obj);
+      out += char(T_FLOAT);
+      out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+      break;
+    }
+    case OT_BOOL:
+      out += char(sq_objtobool(&obj)? T_TRUE: T_FALSE);
+      break;
+    case OT_STRING: {
+      const SQChar* str;
+      SQInteger size;
+      sq_pushobject(v, obj);
+      sq_getstringandsize(v, -1, &str, &size);
+      out += char(T_STRING);
+      text(str, size);
+      sq_pop(v, 1);
+      break;
+    }
+    default:
+      out += char(T_NULL);
+    }
+  }
+
+  void nested(const std::string& path, int depth) {
+    const char* reason = nullptr;
+    if (!value(path, depth + 1, reason)) {
+      out += char(T_NULL);
+      skipped.push_back(path + ": " + reason);
+    }
+  }
+
+  std::string keyName(SQInteger idx) {
+    if (sq_gettype(v, idx) == OT_STRING) return vm.getString(idx);
+    return vm.getAsString(idx);
+  }
+
+  VM& vm;
+  HSQUIRRELVM v;
+  const std::unordered_map<const void*, std::string>& baselineKeys;
+  std::vector<std::string>& skipped;
+  std::unordered_map<const void*, size_t> refs;
+};
+
+class Decoder {
+public:
+  Decoder(VM& vm, const char* data, size_t size)
+      : vm(vm), v(vm.handle()), pos(data), end(data + size) {}
+
+  ~Decoder() {
+    for (HSQOBJECT& obj: refs)
+      sq_release(v, &obj);
+  }
+
+  void header() {
+    need(sizeof(MAGIC) + 4);
+    if (std::memcmp(pos, MAGIC, sizeof(MAGIC)) != 0) corrupt("not a snapshot");
+    pos += sizeof(MAGIC);
+    if ((byte() != VERSION) || (byte() != sizeof(SQInteger)) ||
+        (byte() != sizeof(SQFloat)) || (byte() != sizeof(SQChar)))
+      corrupt("written by an incompatible build");
+  }
+
+  std::uint64_t varint() {
+    std::uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      const unsigned char b = byte();
+      value |= std::uint64_t(b & 0x7F) << shift;
+      if (!(b & 0x80)) return value;
+    }
+    corrupt("bad number");
+    return 0;
+  }
+
+  // Pushes the next value
+  void push(int depth = 0) {
+    if (depth >= MAX_DEPTH) corrupt("nested too deep");
+    switch (byte()) {
+    case T_NULL:
+      sq_pushnull(v);
+      break;
+    case T_INTEGER: {
+      const std::uint64_t value = varint();
+      sq_pushinteger(v, SQInteger(std::int64_t(value >> 1) ^ -std::int64_t(value & 1)));
+      break;
+    }
+    case T_FLOAT: {
+      SQFloat value;
+      need(sizeof(value));
+      std::memcpy(&value, pos, sizeof(value));
+      pos += sizeof(value);
+      sq_pushfloat(v, value);
+      break;
+    }
+    case T_TRUE:
+      sq_pushbool(v, SQTrue);
+      break;
+    case T_FALSE:
+      sq_pushbool(v, SQFalse);
+      break;
+    case T_STRING: {
+      const size_t size = length(sizeof(SQChar));
+      sq_pushstring(v, reinterpret_cast<const SQChar*>(pos), size);
+      pos += size * sizeof(SQChar);
+      break;
+    }
+    case T_ARRAY: {
+      const SQInteger size = length(1);
+      sq_newarray(v, size);
+      reference();
+      for (SQInteger i = 0; i < size; ++i) {
+        sq_pushinteger(v, i);
+        push(depth + 1);
+        sq_rawset(v, -3);
+      }
+      break;
+    }
+    case T_TABLE: {
+      const SQInteger size = length(2);
+      sq_newtableex(v, size);
+      reference();
+      for (SQInteger i = 0; i < size; ++i) {
+        push(depth + 1);
+        if (sq_gettype(v, -1) == OT_NULL) corrupt("null key");
+        push(depth + 1);
+        sq_newslot(v, -3, SQFalse);
+      }
+      break;
+    }
+    case T_CLOSURE: {
+      const size_t size = length(1);
+      vm.readClosure(pos, size);
+      pos += size;
+      reference();
+      break;
+    }
+    case T_ROOT: {
+      const size_t size = length(sizeof(SQChar));
+      sq_pushroottable(v);
+      sq_pushstring(v, reinterpret_cast<const SQChar*>(pos), size);
+      pos += size * sizeof(SQChar);
+      if (!SQ_SUCCEEDED(sq_rawget(v, -2)))
+        corrupt("refers to a root slot this VM doesn't have");
+      sq_remove(v, -2);
+      break;
+    }
+    case T_REF: {
+      const std::uint64_t index = varint();
+      if (index >= refs.size()) corrupt("bad reference");
+      sq_pushobject(v, refs[index]);
+      break;
+    }
+    default:
+      corrupt("unknown value");
+    }
+  }
+
+  void corrupt(const char* reason) {
+    throw VM::Error(&vm, 0, std::string("Corrupt snapshot: ") + reason);
+  }
+
+private:
+  unsigned char byte() {
+    need(1);
+    return static_cast<unsigned char>(*pos++);
+  }
+
+  void need(size_t size) {
+    if (size_t(end - pos) < size) corrupt("truncated");
+  }
+
+  // Element count or byte length, checked against what's left
+  size_t length(size_t minItemSize) {
+    const std::uint64_t size = varint();
+    if (size > size_t(end - pos) / minItemSize) corrupt("truncated");
+    return size_t(size);
+  }
+
+  void reference() {
+    HSQOBJECT obj;
+    sq_getstackobj(v, -1, &obj);
+    sq_addref(v, &obj);
+    refs.push_back(obj);
+  }
+
+  VM& vm;
+  HSQUIRRELVM v;
+  const char* pos;
+  const char* end;
+  std::vector<HSQOBJECT> refs;
+};
+
+// A patch is the library (a root reference), a key and the value. Removed
+// slots can't be expressed and are only reported.
+size_t writePatches(VM& vm, Encoder& encoder, const std::string& libraryName,
+                    const HSQOBJECT& library, const HSQOBJECT& slots,
+                    std::vector<std::string>& skipped) {
+  HSQUIRRELVM v = vm.handle();
+  const SQInteger top = sq_gettop(v);
+  size_t count = 0;
+  sq_pushobject(v, library);
+  sq_pushobject(v, slots);
+
+  sq_pushnull(v);
+  while (SQ_SUCCEEDED(sq_next(v, top + 2))) {
+    sq_pop(v, 1);
+    sq_push(v, -1);
+    if (SQ_SUCCEEDED(sq_rawget(v, top + 1))) {
+      sq_pop(v, 2);
+      continue;
+    }
+    skipped.push_back(libraryName + '.' + vm.getAsString(-1) + ": removed from library");
+    sq_pop(v, 1);
+  }
+  sq_settop(v, top + 2);
+
+  sq_pushnull(v);
+  while (SQ_SUCCEEDED(sq_next(v, top + 1))) {
+    HSQOBJECT value, old;
+    sq_getstackobj(v, -1, &value);
+    sq_push(v, -2);
+    bool unchanged = false;
+    if (SQ_SUCCEEDED(sq_rawget(v, top + 2))) {
+      sq_getstackobj(v, -1, &old);
+      unchanged = sameObject(old, value);
+    }
+    sq_settop(v, top + 5);
+    if (unchanged) {
+      sq_pop(v, 2);
+      continue;
+    }
+
+    const std::string name = libraryName + '.' +
+        ((sq_gettype(v, -2) == OT_STRING)? vm.getString(-2): vm.getAsString(-2));
+    if (!isScalar(sq_gettype(v, -2))) {
+      skipped.push_back(name + ": key of type " + vm.valueTypeName(-2));
+      sq_pop(v, 2);
+      continue;
+    }
+    const size_t mark = encoder.out.size();
+    const char* reason = nullptr;
+    sq_push(v, top + 1);
+    bool written = encoder.value(name, 0, reason);
+    sq_pop(v, 1);
+    sq_push(v, -2);
+    written = written && encoder.value(name, 0, reason);
+    sq_pop(v, 1);
+    if (written && encoder.value(name, 0, reason)) {
+      ++count;
+    } else {
+      encoder.out.resize(mark);
+      skipped.push_back(name + ": " + reason);
+    }
+    sq_pop(v, 2);
+  }
+  sq_settop(v, top);
+  return count;
+}
+
+}
+
+SnapshotWriter::SnapshotWriter(VM& vm): vm(vm) {
+  Allocator::Scope allocatorScope(vm.getAllocator());
+  HSQUIRRELVM v = vm.handle();
+  sq_pushroottable(v);
+  sq_clone(v, -1);
+  sq_getstackobj(v, -1, &baseline);
+  sq_addref(v, &baseline);
+  sq_pushnull(v);
+  while (SQ_SUCCEEDED(sq_next(v, -2))) {
+    HSQOBJECT value;
+    sq_getstackobj(v, -1, &value);
+    if ((sq_gettype(v, -2) == OT_STRING) && !isScalar(value._type) &&
+        baselineKeys.emplace(value._unVal.pRefCounted, vm.getString(-2)).second &&
+        ((value._type == OT_TABLE) || (value._type == OT_CLASS))) {
+      // Library slots are diffed on write
+      HSQOBJECT slots;
+      copySlots(v);
+      sq_getstackobj(v, -1, &slots);
+      sq_addref(v, &value);
+      sq_addref(v, &slots);
+      libraries.emplace_back(value, slots);
+      sq_pop(v, 1);
+    }
+    sq_pop(v, 2);
+  }
+  sq_pop(v, 3);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  Allocator::Scope allocatorScope(vm.getAllocator());
+  sq_release(vm.handle(), &baseline);
+  for (auto& library: libraries) {
+    sq_release(vm.handle(), &library.first);
+    sq_release(vm.handle(), &library.second);
+  }
+}
+
+std::string SnapshotWriter::write() {
+  Allocator::Scope allocatorScope(vm.getAllocator());
+  HSQUIRRELVM v = vm.handle();
+  const SQInteger top = sq_gettop(v);
+  skippedValues.clear();
+  Encoder encoder(vm, baselineKeys, skippedValues);
+  size_t count = 0;
+  size_t recordsEnd = 0;
+  size_t patchCount = 0;
+  try {
+    sq_pushroottable(v);
+    sq_pushnull(v);
+    while (SQ_SUCCEEDED(sq_next(v, -2))) {
+      // Unchanged slots come with the new VM
+      HSQOBJECT value, old;
+      sq_getstackobj(v, -1, &value);
+      sq_pushobject(v, baseline);
+      sq_push(v, -3);
+      bool unchanged = false;
+      if (SQ_SUCCEEDED(sq_rawget(v, -2))) {
+        sq_getstackobj(v, -1, &old);
+        unchanged = sameObject(old, value);
+      }
+      sq_settop(v, top + 4);
+      if (unchanged) {
+        sq_pop(v, 2);
+        continue;
+      }
+
+      const std::string name = (sq_gettype(v, -2) == OT_STRING)? vm.getString(-2): vm.getAsString(-2);
+      if (!isScalar(sq_gettype(v, -2))) {
+        skippedValues.push_back(name + ": key of type " + vm.valueTypeName(-2));
+        sq_pop(v, 2);
+        continue;
+      }
+      const size_t mark = encoder.out.size();
+      sq_push(v, -2);
+      const char* reason = nullptr;
+      const bool keyWritten = encoder.value(name, 0, reason);
+      sq_pop(v, 1);
+      if (keyWritten && encoder.value(name, 0, reason)) {
+        ++count;
+      } else {
+        encoder.out.resize(mark);
+        skippedValues.push_back(name + ": " + reason);
+      }
+      sq_pop(v, 2);
+    }
+    sq_settop(v, top);
+
+    recordsEnd = encoder.out.size();
+    for (auto& library: libraries) {
+      const std::string& name = baselineKeys.find(library.first._unVal.pRefCounted)->second;
+      patchCount += writePatches(vm, encoder, name, library.first, library.second, skippedValues);
+    }
+  } catch (...) {
+    sq_settop(v, top);
+    throw;
+  }
+  sq_settop(v, top);
+
+  std::string result(MAGIC, sizeof(MAGIC));
+  result += char(VERSION);
+  result += char(sizeof(SQInteger));
+  result += char(sizeof(SQFloat));
+  result += char(sizeof(SQChar));
+  appendVarint(result, count);
+  result.append(encoder.out, 0, recordsEnd);
+  appendVarint(result, patchCount);
+  result.append(encoder.out, recordsEnd, std::string::npos);
+  return result;
+}
+
+void SnapshotWriter::writeToFile(const std::string& fileName) {
+  const std::string data = write();
+  std::ofstream file(fileName, std::ios::binary);
+  file.write(data.data(), data.size());
+  if (!file)
+    throw VM::Error(&vm, 0, "Can't write snapshot " + fileName);
+}
+
+void restoreSnapshot(VM& vm, const char* data, size_t size) {
+  Allocator::Scope allocatorScope(vm.getAllocator());
+  HSQUIRRELVM v = vm.handle();
+  const SQInteger top = sq_gettop(v);
+  try {
+    Decoder decoder(vm, data, size);
+    decoder.header();
+    const std::uint64_t count = decoder.varint();
+    sq_pushroottable(v);
+    for (std::uint64_t i = 0; i < count; ++i) {
+      decoder.push();
+      if (sq_gettype(v, -1) == OT_NULL) decoder.corrupt("null root key");
+      decoder.push();
+      if (!SQ_SUCCEEDED(sq_newslot(v, -3, SQFalse)))
+        throw VM::Error(&vm, 0, VM::Error::Static("Can't add snapshot slot to the root table"));
+    }
+    sq_pop(v, 1);
+
+    const std::uint64_t patches = decoder.varint();
+    for (std::uint64_t i = 0; i < patches; ++i) {
+      decoder.push();
+      if ((sq_gettype(v, -1) != OT_TABLE) && (sq_gettype(v, -1) != OT_CLASS))
+        decoder.corrupt("patch of a value that isn't a library");
+      decoder.push();
+      if (sq_gettype(v, -1) == OT_NULL) decoder.corrupt("null library key");
+      decoder.push();
+      if (!SQ_SUCCEEDED(sq_newslot(v, -3, SQFalse)))
+        throw VM::Error(&vm, 0, VM::Error::Static("Can't apply snapshot slot to a library"));
+      sq_pop(v, 1);
+    }
+  } catch (...) {
+    sq_settop(v, top);
+    throw;
+  }
+  sq_settop(v, top);
+}
+
+}
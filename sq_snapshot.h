@@ -0,0 +1,58 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sq {
+
+// Snapshot of what initialization scripts added to the root table, so a
+// new VM gets it without compiling or running them (see VM::loadSnapshot).
+// Root slots added or replaced after the writer was created are stored:
+// closures as bytecode (sq_writeclosure), strings, numbers, bools, arrays
+// and tables in a compact tagged format that keeps shared and cyclic
+// containers shared. Values that were in the root table before (library
+// functions and tables) are stored by their root key. Slots added to or
+// replaced in library tables and classes are stored too, slots removed
+// from them are listed in skipped().
+// Classes, instances, userdata, closures with free variables and the
+// const table are not stored: such root slots are skipped, nested ones
+// become null, each is listed in skipped(). Restored closures are not
+// bound to an environment.
+//
+// Usage:
+//   VM vm;
+//   SnapshotWriter snapshot(vm);
+//   vm.doFile("lib.nut");
+//   snapshot.writeToFile("lib.sqsnap");
+//   ...
+//   VM fast(nullptr, 1024, nullptr, "lib.sqsnap");
+class SnapshotWriter {
+public:
+  explicit SnapshotWriter(VM& vm);
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  ~SnapshotWriter();
+
+  std::string write();
+  void writeToFile(const std::string& fileName);
+
+  // "path: reason" for every value left out by the last write
+  inline const std::vector<std::string>& skipped() const { return skippedValues; }
+
+private:
+  VM& vm;
+  HSQOBJECT baseline;
+  std::unordered_map<const void*, std::string> baselineKeys;
+  // Library tables and classes of the baseline with a copy of their slots
+  std::vector<std::pair<HSQOBJECT, HSQOBJECT>> libraries;
+  std::vector<std::string> skippedValues;
+};
+
+// Adds the snapshot's root slots to vm's root table, throws VM::Error on a
+// malformed snapshot or one written for other SQInteger/SQFloat sizes
+void restoreSnapshot(VM& vm, const char* data, size_t size);
+
+}
@@ -0,0 +1,373 @@
+#include "sq_socket_console.h"
+
+#if defined(__linux__)
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace sq {
+
+// Print output is collected for the session that runs the command
+class SocketConsole::Session: public ConsoleBase {
+public:
+  explicit Session(int fd): fd(fd) {
+    vm = nullptr;
+  }
+
+  virtual void onSqPrintData(VM* vm, const char* data, size_t size) override {
+    output.append(data, size);
+  }
+
+  virtual void onSqErrorData(VM* vm, const char* data, size_t size) override {
+    output.append(data, size).push_back('\n');
+  }
+
+  virtual void onSqCompileError(
+                 VM* vm,
+                 const std::string& desc,
+                 const std::string& source,
+                 SQInteger line,
+                 SQInteger column) override {
+    output += desc + " in " + source + " on line " + std::to_string(line) +
+              " column " + std::to_string(column) + '\n';
+  }
+
+  int fd;
+  std::string input;   // unfinished line
+  std::string output;  // not sent yet
+  bool waitingOutput = false;
+  bool quit = false;
+  std::unique_ptr<VMPool::Lease> lease;
+};
+
+#if defined(__linux__)
+
+namespace {
+
+VM::Error systemError(const std::string& what) {
+  return VM::Error(nullptr, 0, what + ": " + std::strerror(errno));
+}
+
+}
+
+SocketConsole::SocketConsole(const Options& options)
+    : options(options), readBuffer(READ_CHUNK), stopping(false) {
+  if (!options.pool == !options.vm)
+    throw VM::Error(nullptr, 0, VM::Error::Static("SocketConsole needs either a VM pool or a shared VM"));
+  epoll = ::epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) throw systemError("Can't create epoll instance");
+  wakeUp = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = wakeUp;
+  if ((wakeUp < 0) || (::epoll_ctl(epoll, EPOLL_CTL_ADD, wakeUp, &event) < 0)) {
+    const VM::Error error = systemError("Can't set up console wake up");
+    if (wakeUp >= 0) ::close(wakeUp);
+    ::close(epoll);
+    throw error;
+  }
+  spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+SocketConsole::~SocketConsole() {
+  while (!sessions.empty())
+    closeSession(sessions.begin()->first);
+  for (int fd: listeners)
+    ::close(fd);
+  for (const std::string& path: socketFiles)
+    ::unlink(path.c_str());
+  if (spareFd >= 0) ::close(spareFd);
+  ::close(wakeUp);
+  ::close(epoll);
+}
+
+void SocketConsole::listenUnix(const std::string& path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    throw VM::Error(nullptr, 0, "Socket path is too long: " + path);
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  // Only a leftover socket is replaced, never another kind of file
+  struct stat info;
+  if ((::lstat(path.c_str(), &info) == 0) && S_ISSOCK(info.st_mode))
+    ::unlink(path.c_str());
+
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw systemError("Can't create socket");
+  // Nobody can connect before listen(), so the mode is set in time
+  if ((::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) ||
+      (::chmod(path.c_str(), 0600) < 0) ||
+      (::listen(fd, SOMAXCONN) < 0)) {
+    const VM::Error error = systemError("Can't listen on " + path);
+    ::close(fd);
+    throw error;
+  }
+  socketFiles.push_back(path);
+  addListener(fd);
+}
+
+void SocketConsole::listenTcp(unsigned short port) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw systemError("Can't create socket");
+  const int reuse = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if ((::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) ||
+      (::listen(fd, SOMAXCONN) < 0)) {
+    const VM::Error error = systemError("Can't listen on port " + std::to_string(port));
+    ::close(fd);
+    throw error;
+  }
+  addListener(fd);
+}
+
+void SocketConsole::addListener(int fd) {
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (::epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+    const VM::Error error = systemError("Can't watch listening socket");
+    ::close(fd);
+    throw error;
+  }
+  listeners.push_back(fd);
+}
+
+void SocketConsole::run() {
+  epoll_event events[64];
+  while (!stopping.load()) {
+    const int count = ::epoll_wait(epoll, events, 64, -1);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      throw systemError("epoll_wait failed");
+    }
+    for (int i = 0; i < count; ++i) {
+      const int fd = events[i].data.fd;
+      if (fd == wakeUp) {
+        std::uint64_t value;
+        while (::read(wakeUp, &value, sizeof(value)) > 0) {}
+        continue;
+      }
+      if (std::find(listeners.begin(), listeners.end(), fd) != listeners.end()) {
+        accept(fd);
+        continue;
+      }
+      // May have been closed by an earlier event of this round
+      auto found = sessions.find(fd);
+      if (found == sessions.end()) continue;
+      Session& session = *found->second;
+      if (events[i].events & EPOLLERR) {
+        closeSession(fd);
+      } else if ((events[i].events & EPOLLOUT) && !flush(session)) {
+        closeSession(fd);
+      } else if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+        onReadable(session);
+      }
+    }
+  }
+}
+
+void SocketConsole::stop() {
+  stopping.store(true);
+  const std::uint64_t value = 1;
+  while ((::write(wakeUp, &value, sizeof(value)) < 0) && (errno == EINTR)) {}
+}
+
+void SocketConsole::accept(int listener) {
+  for (;;) {
+    const int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      // Out of descriptors the listener stays readable and the loop would
+      // spin: the spare descriptor makes room to take the connection off
+      // the backlog and close it
+      if (((errno == EMFILE) || (errno == ENFILE)) && (spareFd >= 0)) {
+        ::close(spareFd);
+        const int rejected = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (rejected >= 0) ::close(rejected);
+        spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        continue;
+      }
+      return;
+    }
+    if (sessions.size() >= options.maxSessions) {
+      static const char busy[] = "Too many sessions\n";
+      ::send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+      ::close(fd);
+      continue;
+    }
+
+    std::unique_ptr<Session> session(new Session(fd));
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    try {
+      if (options.pool) {
+        session->lease.reset(new VMPool::Lease(options.pool->acquire()));
+        session->vm = session->lease->get();
+      } else {
+        session->vm = options.vm;
+      }
+    } catch (std::exception&) {
+      ::close(fd);
+      continue;
+    }
+    if (::epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+      ::close(fd);
+      continue;
+    }
+    Session& added = *session;
+    sessions[fd] = std::move(session);
+    writePrompt(added);
+    if (!flush(added)) closeSession(fd);
+  }
+}
+
+// One read per readiness event, so a client sending a lot can't starve
+// the others
+void SocketConsole::onReadable(Session& session) {
+  const int fd = session.fd;
+  ssize_t got;
+  do {
+    got = ::read(fd, readBuffer.data(), readBuffer.size());
+  } while ((got < 0) && (errno == EINTR));
+  if ((got < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return;
+  if (got <= 0) {
+    closeSession(fd);
+    return;
+  }
+
+  const char* pos = readBuffer.data();
+  const char* end = pos + got;
+  while ((pos < end) && !session.quit) {
+    const char* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+    if (!newline) {
+      session.input.append(pos, end);
+      break;
+    }
+    if (session.input.empty()) {
+      onLine(session, pos, newline - pos);
+    } else {
+      session.input.append(pos, newline);
+      onLine(session, session.input.data(), session.input.size());
+      session.input.clear();
+    }
+    pos = newline + 1;
+  }
+
+  if (session.quit) {
+    flush(session);
+    closeSession(fd);
+  } else if ((session.input.size() + session.currentCommand.size() > options.maxCommandBytes) ||
+             !flush(session)) {
+    closeSession(fd);
+  }
+}
+
+void SocketConsole::onLine(Session& session, const char* line, size_t size) {
+  if (session.currentCommand.empty() && size && (line[0] == ':')) {
+    std::string command(line, size);
+    while (!command.empty() && std::isspace(static_cast<unsigned char>(command.back())))
+      command.pop_back();
+    if (command == ":quit") {
+      session.quit = true;
+      return;
+    }
+    session.output += "Unknown command " + command + '\n';
+  } else if (session.isCommandComplete(line, size)) {
+    execute(session);
+  }
+  writePrompt(session);
+}
+
+void SocketConsole::execute(Session& session) {
+  std::unique_lock<std::mutex> lock;
+  if (options.vmMutex) lock = std::unique_lock<std::mutex>(*options.vmMutex);
+  // A shared VM prints to its own handler again afterwards
+  VM::PrintHandler* handler = session.vm->printHandler;
+  try {
+    session.output += session.interpretCommand();
+    session.output += '\n';
+  } catch (std::exception& e) {
+    // Not just VM::Error, native code must not take the loop down
+    session.output += e.what();
+    session.output += '\n';
+  }
+  session.vm->printHandler = handler;
+}
+
+void SocketConsole::writePrompt(Session& session) {
+  if (!options.prompt) return;
+  session.output += '>';
+  if (session.blocks > 0) session.output.append(session.blocks, '>');
+  if (session.inString) session.output += "...";
+  session.output += ' ';
+}
+
+bool SocketConsole::flush(Session& session) {
+  size_t sent = 0;
+  while (sent < session.output.size()) {
+    const ssize_t count = ::send(session.fd, session.output.data() + sent,
+                                 session.output.size() - sent, MSG_NOSIGNAL);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+      return false;
+    }
+    sent += count;
+  }
+  session.output.erase(0, sent);
+
+  const bool waiting = !session.output.empty();
+  if (waiting != session.waitingOutput) {
+    epoll_event event = {};
+    event.events = waiting? (EPOLLIN | EPOLLOUT): EPOLLIN;
+    event.data.fd = session.fd;
+    if (::epoll_ctl(epoll, EPOLL_CTL_MOD, session.fd, &event) < 0) return false;
+    session.waitingOutput = waiting;
+  }
+  return session.output.size() <= options.maxOutputBytes;
+}
+
+void SocketConsole::closeSession(int fd) {
+  ::epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+  ::close(fd);
+  // Returns a leased VM to the pool
+  sessions.erase(fd);
+}
+
+#else
+
+SocketConsole::SocketConsole(const Options& options): options(options), stopping(false) {
+  throw VM::Error(nullptr, 0, VM::Error::Static("Socket console is not supported on this platform"));
+}
+
+SocketConsole::~SocketConsole() {
+}
+
+void SocketConsole::listenUnix(const std::string& path) {}
+void SocketConsole::listenTcp(unsigned short port) {}
+void SocketConsole::run() {}
+void SocketConsole::stop() {}
+
+#endif
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "sq_console_base.h"
+#include "sq_vm_pool.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sq {
+
+// Remote console: serves ConsoleBase to clients of Unix domain and
+// loopback TCP sockets from a single epoll loop (Linux only), without a
+// thread per connection. A session gets its own VM leased from a pool
+// (reset to the pristine state when it disconnects, see
+// VM::resetToPristine for what a reset can't undo; such VMs are dropped
+// by the pool), or all sessions share one VM, e.g. a live
+// one of the application; commands on it run under vmMutex, which the
+// application must hold too while it uses the VM.
+// The protocol is TextConsole's: lines of script, '=' for commands whose
+// value is printed, the same prompts. ":quit" ends the session.
+// Commands run on the loop thread, a long one delays the other sessions.
+//
+// Usage:
+//   VMPool pool(2);
+//   SocketConsole::Options options;
+//   options.pool = &pool;
+//   SocketConsole console(options);
+//   console.listenUnix("/run/app/console.sock");
+//   std::thread loop([&]() { console.run(); });
+//   ...
+//   console.stop();
+//   loop.join();
+class SocketConsole {
+public:
+  struct Options {
+    VMPool* pool = nullptr;  // either a pool for per-session VMs
+    VM* vm = nullptr;        // or a shared VM
+    std::mutex* vmMutex = nullptr;
+    size_t maxSessions = 16;
+    // Sessions exceeding these are closed
+    size_t maxCommandBytes = 1 << 20;
+    size_t maxOutputBytes = 4 << 20;
+    bool prompt = true;
+  };
+
+  explicit SocketConsole(const Options& options);
+  SocketConsole(const SocketConsole&) = delete;
+  ~SocketConsole();
+
+  // Both throw VM::Error when the socket can't be set up. A stale socket
+  // file is replaced and the new one is made accessible to the owner only.
+  void listenUnix(const std::string& path);
+  void listenTcp(unsigned short port);  // 127.0.0.1 only
+
+  // Serves until stop(), which may be called from any thread
+  void run();
+  void stop();
+
+  inline size_t sessionCount() const { return sessions.size(); }
+
+private:
+  class Session;
+
+  static const size_t READ_CHUNK = 64 * 1024;
+
+  void addListener(int fd);
+  void accept(int listener);
+  void onReadable(Session& session);
+  void onLine(Session& session, const char* line, size_t size);
+  void execute(Session& session);
+  void writePrompt(Session& session);
+  // False if the session is broken or its unsent output is over the limit
+  bool flush(Session& session);
+  void closeSession(int fd);
+
+  Options options;
+  int epoll = -1;
+  int wakeUp = -1;
+  int spareFd = -1;  // closed to reject connections when out of descriptors
+  std::vector<int> listeners;
+  std::vector<std::string> socketFiles;
+  std::unordered_map<int, std::unique_ptr<Session>> sessions;
+  std::vector<char> readBuffer;
+  std::atomic<bool> stopping;
+};
+
+}
@@ -1,15 +1,44 @@
 #include "sq_text_console.h"
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace sq {
 
-void TextConsole::onSqPrint(VM* vm, const std::string& message) {
-  std::cout << message;
+namespace {
+
+// Command arguments are typed by hand, bad ones get the usage message
+bool parseCount(const std::string& text, size_t& count) {
+  if (text.empty() || (text[0] < '0') || (text[0] > '9')) return false;
+  char* end;
+  errno = 0;
+  const unsigned long value = std::strtoul(text.c_str(), &end, 10);
+  if (*end || (errno == ERANGE)) return false;
+  count = value;
+  return true;
+}
+
 }
 
-void TextConsole::onSqError(VM* vm, const std::string& message) {
-  std::cerr << message << std::endl;
+void TextConsole::onSqPrintData(VM* vm, const char* data, size_t size) {
+  if (batchMode) printed.append(data, size);
+  else std::cout.write(data, size);
+}
+
+// cerr is unbuffered, no flush needed
+void TextConsole::onSqErrorData(VM* vm, const char* data, size_t size) {
+  if (batchMode) errors.append(data, size).push_back('\n');
+  else std::cerr.write(data, size) << '\n';
 }
 
 void TextConsole::onSqCompileError(
@@ -18,7 +47,12 @@ void TextConsole::onSqCompileError(
                     const std::string& source,
                     SQInteger line,
                     SQInteger column) {
-  std::cerr << desc << " in " << source << " on line " << line << " column " << column << std::endl;
+  if (batchMode) {
+    errors += desc + " in " + source + " on line " + std::to_string(line) +
+              " column " + std::to_string(column) + '\n';
+  } else {
+    std::cerr << desc << " in " << source << " on line " << line << " column " << column << std::endl;
+  }
 }
 
 bool TextConsole::reps() {
@@ -32,6 +66,10 @@ bool TextConsole::reps() {
     std::cout << ' ';
     std::getline(std::cin, line);
     if (!std::cin) return false;
+    if (currentCommand.empty() && !line.empty() && (line[0] == ':')) {
+      runConsoleCommand(line);
+      return true;
+    }
   } while (!isCommandComplete(line));
   try {
     std::cout << interpretCommand() << std::endl;
@@ -43,8 +81,188 @@ bool TextConsole::reps() {
 
 void TextConsole::repl() {
   while (reps());
+  if (profiler) profiler->detach();
+}
+
+bool TextConsole::batch(int fd) {
+#if defined(__unix__) || defined(__APPLE__)
+  batchMode = true;
+  sequence = 0;
+  std::vector<char> chunk(BATCH_CHUNK);
+  // Only the unfinished last line of a chunk is carried over
+  std::string partial;
+  bool ok = true;
+  for (;;) {
+    const ssize_t got = ::read(fd, chunk.data(), chunk.size());
+    if ((got < 0) && (errno == EINTR)) continue;
+    if (got <= 0) {
+      ok = (got == 0);
+      break;
+    }
+    const char* pos = chunk.data();
+    const char* end = pos + got;
+    while (pos < end) {
+      const char* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+      if (!newline) {
+        partial.append(pos, end);
+        break;
+      }
+      if (partial.empty()) {
+        batchLine(pos, newline - pos);
+      } else {
+        partial.append(pos, newline);
+        batchLine(partial.data(), partial.size());
+        partial.clear();
+      }
+      pos = newline + 1;
+    }
+    // Replies go out once per chunk, drivers waiting on a pipe get them
+    // as soon as their input is consumed
+    flushFrames();
+  }
+  if (!partial.empty()) batchLine(partial.data(), partial.size());
+  if (!currentCommand.empty()) {
+    ++sequence;
+    frame("fail", "Incomplete command at end of input");
+    currentCommand.clear();
+  }
+  flushFrames();
+  batchMode = false;
+  if (profiler) profiler->detach();
+  return ok;
+#else
+  std::cerr << "Batch mode is not supported on this platform" << std::endl;
+  return false;
+#endif
 }
 
+bool TextConsole::batch(const std::string& fileName) {
+#if defined(__unix__) || defined(__APPLE__)
+  const int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Can't open " << fileName << std::endl;
+    return false;
+  }
+  const bool ok = batch(fd);
+  ::close(fd);
+  return ok;
+#else
+  return batch(0);
+#endif
+}
+
+void TextConsole::batchLine(const char* line, size_t size) {
+  if (currentCommand.empty() && size && (line[0] == ':')) {
+    ++sequence;
+    std::ostringstream out, err;
+    // A failing command must not end the stream
+    try {
+      runConsoleCommand(std::string(line, size), out, err);
+    } catch (std::exception& e) {
+      err << e.what() << std::endl;
+    }
+    const std::string failure = err.str();
+    if (failure.empty()) frame("ok", out.str());
+    else frame("fail", failure);
+    return;
+  }
+  if (!isCommandComplete(line, size)) return;
+
+  ++sequence;
+  printed.clear();
+  errors.clear();
+  std::string result;
+  const char* kind = "ok";
+  try {
+    result = interpretCommand();
+  } catch (std::exception& e) {
+    kind = "fail";
+    result = e.what();
+  }
+  if (!printed.empty()) frame("print", printed);
+  if (!errors.empty()) frame("error", errors);
+  frame(kind, result);
+}
+
+void TextConsole::frame(const char* kind, const std::string& payload) {
+  frames += kind;
+  frames += ' ';
+  frames += std::to_string(sequence);
+  frames += ' ';
+  frames += std::to_string(payload.size());
+  frames += '\n';
+  frames += payload;
+  frames += '\n';
+}
+
+void TextConsole::flushFrames() {
+  if (frames.empty()) return;
+  std::cout.write(frames.data(), frames.size());
+  std::cout.flush();
+  frames.clear();
+}
+
+void TextConsole::runConsoleCommand(
+                    const std::string& command,
+                    std::ostream& out,
+                    std::ostream& err) {
+  std::istringstream args(command.substr(1));
+  std::string name, action, arg;
+  args >> name >> action >> arg;
+  if (name == "gc") {
+    runGcCommand(action, arg, out, err);
+    return;
+  }
+  if (name != "profile") {
+    err << "Unknown command :" << name << std::endl;
+    return;
+  }
+
+  size_t limit = 20;
+
+  if (action == "start") {
+    if ((arg != "") && (arg != "exact") && (arg != "sampling")) {
+      err << "Unknown profiler mode " << arg << std::endl;
+      return;
+    }
+    profiler.reset(new Profiler((arg == "sampling")? Profiler::SAMPLING: Profiler::EXACT));
+    profiler->attach(vm);
+  } else if (!profiler) {
+    err << "Profiler is not started" << std::endl;
+  } else if (action == "stop") {
+    profiler->detach();
+  } else if ((action == "report") && (arg.empty() || parseCount(arg, limit))) {
+    profiler->writeSummary(out, limit);
+  } else if ((action == "folded") && !arg.empty()) {
+    std::ofstream file(arg);
+    profiler->writeFolded(file);
+    if (!file) err << "Can't write " << arg << std::endl;
+  } else {
+    err << "Usage: :profile start [exact|sampling] | stop | report [limit] | folded <file>" << std::endl;
+  }
+}
+
+void TextConsole::runGcCommand(
+                    const std::string& action,
+                    const std::string& arg,
+                    std::ostream& out,
+                    std::ostream& err) {
+  size_t limit = 50;
+  try {
+    if (!gc) gc.reset(new GarbageCollector(*vm));
+    if (action == "collect") {
+      out << gc->collect() << " objects collected" << std::endl;
+    } else if (action == "stats") {
+      gc->writeStats(out);
+    } else if ((action == "leaks") && (arg.empty() || parseCount(arg, limit))) {
+      GarbageCollector::writeLeakReport(out, gc->findLeaks(), limit);
+    } else {
+      err << "Usage: :gc collect | stats | leaks [limit]" << std::endl;
+    }
+  } catch (std::exception& e) {
+    err << e.what() << std::endl;
+  }
+}
 
 }
 
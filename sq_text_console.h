@@ -1,13 +1,19 @@
 #pragma once
 
 #include "sq_console_base.h"
+#include "sq_gc.h"
+#include "sq_profiler.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
 
 namespace sq {
 
 class TextConsole: public ConsoleBase {
 public:
-  virtual void onSqPrint(VM* vm, const std::string& message) override;
-  virtual void onSqError(VM* vm, const std::string& message) override;
+  virtual void onSqPrintData(VM* vm, const char* data, size_t size) override;
+  virtual void onSqErrorData(VM* vm, const char* data, size_t size) override;
   virtual void onSqCompileError(
                  VM* vm,
                  const std::string& desc,
@@ -18,6 +24,49 @@ public:
   bool reps();
   void repl();
 
+  // Batch mode for driving the console over pipes: input is read in
+  // chunks (from a pipe, what's available), no prompts are shown, every
+  // command gets frames
+  //   <kind> <sequence> <length>\n<payload>\n
+  // print and error frames carry the command's output if there was any,
+  // then ok has the result ('=' commands) or fail the error message.
+  // Console commands answer with ok or fail. Returns false on read errors.
+  bool batch(int fd = 0);
+  bool batch(const std::string& fileName);
+
+  // Console commands start with ':'
+  //   :profile start [exact|sampling]
+  //   :profile stop
+  //   :profile report [limit]
+  //   :profile folded <file>
+  //   :gc collect
+  //   :gc stats
+  //   :gc leaks [limit]
+  void runConsoleCommand(
+         const std::string& command,
+         std::ostream& out = std::cout,
+         std::ostream& err = std::cerr);
+
+  std::unique_ptr<Profiler> profiler;
+  std::unique_ptr<GarbageCollector> gc;
+
+private:
+  static const size_t BATCH_CHUNK = 64 * 1024;
+
+  void runGcCommand(
+         const std::string& action,
+         const std::string& arg,
+         std::ostream& out,
+         std::ostream& err);
+  void batchLine(const char* line, size_t size);
+  void frame(const char* kind, const std::string& payload);
+  void flushFrames();
+
+  bool batchMode = false;
+  size_t sequence = 0;
+  std::string printed;
+  std::string errors;
+  std::string frames;
 };
 
 }
@@ -0,0 +1,163 @@
+#include "sq_thread.h"
+
+namespace sq {
+
+// Thread
+
+Thread::Thread(VM* parent, SQInteger initialStackSize): VM(*parent, initialStackSize) {
+}
+
+void Thread::throwLastError() {
+  pushLastError();
+  const std::string errorString = getAsString();
+  pop();
+  throw Error(this, -1, errorString);
+}
+
+// sq_call and sq_wakeupvm push the return value even when the script
+// suspends, that placeholder is dropped
+bool Thread::start(SQInteger params) {
+  Allocator::Scope allocatorScope(getAllocator());
+  if (!SQ_SUCCEEDED(sq_call(handle(), params, SQTrue, SQTrue)))
+    throwLastError();
+  if (!isSuspended()) return true;
+  pop();
+  return false;
+}
+
+bool Thread::wakeUp(bool withValue) {
+  Allocator::Scope allocatorScope(getAllocator());
+  if (!SQ_SUCCEEDED(sq_wakeupvm(handle(), withValue? SQTrue: SQFalse, SQTrue, SQTrue, SQFalse)))
+    throwLastError();
+  if (!isSuspended()) return true;
+  pop();
+  return false;
+}
+
+bool Thread::wakeUpWithError(const std::string& message) {
+  Allocator::Scope allocatorScope(getAllocator());
+  sq_throwerror(handle(), message.c_str());
+  if (!SQ_SUCCEEDED(sq_wakeupvm(handle(), SQFalse, SQTrue, SQTrue, SQTrue)))
+    throwLastError();
+  if (!isSuspended()) return true;
+  pop();
+  return false;
+}
+
+// Scheduler
+
+void Scheduler::Waker::resume(Push value) const {
+  post(*inbox, Wakeup{id, generation, std::move(value), false, std::string()});
+}
+
+void Scheduler::Waker::fail(const std::string& message) const {
+  post(*inbox, Wakeup{id, generation, Push(), true, message});
+}
+
+Scheduler::Scheduler(VM* vm): vm(vm), inbox(std::make_shared<Inbox>()) {
+}
+
+Scheduler::~Scheduler() {
+  // Wakers outliving the scheduler post into the closed inbox
+  std::lock_guard<std::mutex> lock(inbox->mutex);
+  inbox->closed = true;
+  inbox->wakeups.clear();
+}
+
+std::uint64_t Scheduler::spawn(SQInteger idx, Done done) {
+  const std::uint64_t id = nextId++;
+  if (idx < 0) idx = vm->getTop() + idx + 1;
+  Thread* thread = new Thread(vm);
+  Task& task = tasks[id];
+  task.thread.reset(thread);
+  task.done = std::move(done);
+  thread->scheduler = this;
+  thread->taskId = id;
+
+  // The script may spawn more tasks, so only the thread pointer is used
+  sq_move(thread->handle(), vm->handle(), idx);
+  thread->pushRootTable();
+  bool finished;
+  try {
+    finished = thread->start(1);
+  } catch (...) {
+    finish(id, std::current_exception());
+    return id;
+  }
+  if (finished) finish(id, nullptr);
+  return id;
+}
+
+SQInteger Scheduler::await(HSQUIRRELVM v, const std::function<void(Waker)>& start) {
+  Thread* thread = dynamic_cast<Thread*>(VM::inst(v));
+  if (!thread || !thread->scheduler)
+    return sq_throwerror(v, "Can't suspend a script outside of a scheduler task");
+  Scheduler* scheduler = thread->scheduler;
+  // Wakers of earlier awaits of the task are ignored from now on
+  const std::uint64_t generation = ++scheduler->tasks.at(thread->taskId).generation;
+  try {
+    start(Waker(scheduler->inbox, thread->taskId, generation));
+  } catch (std::exception& e) {
+    return sq_throwerror(v, e.what());
+  }
+  return thread->suspend();
+}
+
+void Scheduler::post(Inbox& inbox, Wakeup&& wakeup) {
+  std::lock_guard<std::mutex> lock(inbox.mutex);
+  if (inbox.closed) return;
+  inbox.wakeups.push_back(std::move(wakeup));
+  inbox.posted.notify_one();
+}
+
+size_t Scheduler::runOnce(bool wait) {
+  std::vector<Wakeup> ready;
+  {
+    std::unique_lock<std::mutex> lock(inbox->mutex);
+    if (wait)
+      inbox->posted.wait(lock, [this]() { return !inbox->wakeups.empty(); });
+    ready.swap(inbox->wakeups);
+  }
+
+  size_t resumed = 0;
+  for (Wakeup& wakeup: ready) {
+    // Stale and repeated wakeups are dropped, each await is woken once
+    auto found = tasks.find(wakeup.id);
+    if ((found == tasks.end()) || (found->second.generation != wakeup.generation) ||
+        !found->second.thread->isSuspended())
+      continue;
+    ++found->second.generation;
+    Thread& thread = *found->second.thread;
+    ++resumed;
+    bool finished;
+    try {
+      if (wakeup.failed) {
+        finished = thread.wakeUpWithError(wakeup.error);
+      } else if (wakeup.value) {
+        wakeup.value(thread);
+        finished = thread.wakeUp(true);
+      } else {
+        finished = thread.wakeUp(false);
+      }
+    } catch (...) {
+      finish(wakeup.id, std::current_exception());
+      continue;
+    }
+    if (finished) finish(wakeup.id, nullptr);
+  }
+  return resumed;
+}
+
+void Scheduler::run() {
+  while (!tasks.empty())
+    runOnce(true);
+}
+
+void Scheduler::finish(std::uint64_t id, std::exception_ptr error) {
+  auto found = tasks.find(id);
+  Task task = std::move(found->second);
+  tasks.erase(found);
+  if (task.done) task.done(*task.thread, error);
+}
+
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace sq {
+
+class Scheduler;
+
+// Squirrel thread (sq_newthread) sharing the parent's root table and
+// state. A native closure called in it may suspend the script with
+// "return vm->suspend();", the host continues it later with wakeUp().
+class Thread: public VM {
+public:
+  explicit Thread(VM* parent, SQInteger initialStackSize = 1024);
+
+  // Calls the closure below params like VM::call(params, true); returns
+  // false if the script got suspended, otherwise the result is on top
+  bool start(SQInteger params);
+  // Continues a suspended script. With value, the top of the stack becomes
+  // the result of the suspending native call. Returns as start() does.
+  bool wakeUp(bool withValue);
+  // Continues a suspended script by throwing message at the suspension point
+  bool wakeUpWithError(const std::string& message);
+
+  inline bool isSuspended() const { return getState() == SUSPENDED; }
+
+  Scheduler* scheduler = nullptr;
+  std::uint64_t taskId = 0;
+
+private:
+  void throwLastError();
+};
+
+// Runs many Squirrel threads over one VM. Native closures call await()
+// to suspend the calling script until C++ work completes; completions may
+// come from any OS thread, scripts are always resumed on the thread
+// running the scheduler.
+class Scheduler {
+public:
+  // Pushes the value a suspended script receives
+  typedef std::function<void(VM& thread)> Push;
+  // Called when a task ends, with the result on top of thread's stack or
+  // with the error
+  typedef std::function<void(Thread& thread, std::exception_ptr error)> Done;
+
+  // Wakes one await of a task, later calls and calls after the scheduler
+  // is destroyed are ignored
+  class Waker {
+  public:
+    void resume(Push value = Push()) const;
+    void fail(const std::string& message) const;
+
+  private:
+    friend class Scheduler;
+    struct Inbox;
+    Waker(const std::shared_ptr<Inbox>& inbox, std::uint64_t id, std::uint64_t generation)
+        : inbox(inbox), id(id), generation(generation) {}
+
+    std::shared_ptr<Inbox> inbox;
+    std::uint64_t id;
+    std::uint64_t generation;
+  };
+
+  explicit Scheduler(VM* vm);
+  Scheduler(const Scheduler&) = delete;
+  ~Scheduler();
+
+  // Runs the closure at idx in a new thread with the root table as this,
+  // until it finishes or suspends
+  std::uint64_t spawn(SQInteger idx = -1, Done done = Done());
+
+  // For native closures: "return Scheduler::await(v, start);". start gets
+  // the waker of the calling task and should begin the asynchronous work.
+  static SQInteger await(HSQUIRRELVM v, const std::function<void(Waker)>& start);
+
+  // Resumes woken tasks; waits for wakeups if wait is set. Returns the
+  // number of tasks resumed.
+  size_t runOnce(bool wait = false);
+  // Runs until all tasks are done
+  void run();
+
+  inline size_t taskCount() const { return tasks.size(); }
+
+private:
+  struct Task {
+    std::unique_ptr<Thread> thread;
+    Done done;
+    std::uint64_t generation = 0;  // of the current await
+  };
+
+  struct Wakeup {
+    std::uint64_t id;
+    std::uint64_t generation;
+    Push value;
+    bool failed;
+    std::string error;
+  };
+
+  // Shared with the wakers, which may outlive the scheduler
+  typedef Waker::Inbox Inbox;
+
+  static void post(Inbox& inbox, Wakeup&& wakeup);
+  void finish(std::uint64_t id, std::exception_ptr error);
+
+  VM* vm;
+  std::uint64_t nextId = 1;
+  std::unordered_map<std::uint64_t, Task> tasks;
+  std::shared_ptr<Inbox> inbox;
+};
+
+struct Scheduler::Waker::Inbox {
+  std::mutex mutex;
+  std::condition_variable posted;
+  std::vector<Wakeup> wakeups;
+  bool closed = false;
+};
+
+}
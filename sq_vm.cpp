@@ -1,7 +1,19 @@
 #include "sq_vm.h"
+#include "sq_blob.h"
+#include "sq_json.h"
+#include "sq_mapped_file.h"
+#include "sq_snapshot.h"
 
+#include <algorithm>
+#include <chrono>
 #include <sstream>
+#include <fstream>
+#include <memory>
 #include <cstdarg>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <unordered_set>
 #include <sqstdio.h>
 #include <sqstdaux.h>
 #include <sqstdmath.h>
@@ -9,10 +21,25 @@
 #include <sqstdsystem.h>
 #include <sqstdblob.h>
 
-#define SQVM_TOPG TopGuard g(this, true, __FILE__, __LINE__, __FUNCTION__)
-#define SQVM_LTOPG TopGuard g(this, false, __FILE__, __LINE__, __FUNCTION__)
-#define SQVM_CTOPG CTopGuard g(this, __FILE__, __LINE__, __FUNCTION__)
-#define SQVM_ASS(expr) if (!SQ_SUCCEEDED(expr)) throw sq::VM::Error(this, 0, (boost::format("%1% failed in %2%: %3%: %4%") % #expr % __FILE__ % __LINE__ % __FUNCTION__).str())
+// The VM's allocator is current while a wrapper runs
+#ifdef SQVM_CUSTOM_ALLOCATOR
+#define SQVM_ALLOC Allocator::Scope allocatorScope(allocator)
+#else
+#define SQVM_ALLOC
+#endif
+#define SQVM_TOPG SQVM_ALLOC; TopGuard g(this, true, __FILE__, __LINE__, __FUNCTION__)
+#define SQVM_LTOPG SQVM_ALLOC; TopGuard g(this, false, __FILE__, __LINE__, __FUNCTION__)
+#define SQVM_CTOPG SQVM_ALLOC; CTopGuard g(this, true, __FILE__, __LINE__, __FUNCTION__)
+#define SQVM_ASS(expr) if (!SQ_SUCCEEDED(expr)) throw sq::VM::Error(this, 0, #expr, __FILE__, __LINE__, __FUNCTION__)
+#ifdef SQVM_METRICS
+#define SQVM_METRIC(op) \
+  if (metrics) metrics->recordStackTop(sq_gettop(vm)); \
+  Metrics::Scope metricScope(metrics, Metrics::op)
+#define SQVM_METRIC_OK metricScope.succeeded()
+#else
+#define SQVM_METRIC(op)
+#define SQVM_METRIC_OK
+#endif
 
 namespace sq {
 
@@ -24,9 +51,50 @@ const char* TO_STRING = "_tostring";
 const char* TYPE_OF = "_typeof";
 }
 
+const char* VM::Error::what() const noexcept {
+  if (!formatted.empty()) return formatted.c_str();
+  try {
+    formatted = "Squirrel VM error: ";
+    if (expression) {
+      formatted += expression;
+      formatted += " failed";
+    } else if (message) {
+      formatted += message;
+    }
+    if (typeName) {
+      formatted += (expression || message)? ", got value of type ": "value of type ";
+      formatted += typeName;
+    }
+    if (!key.empty()) {
+      if (expression || message || typeName) formatted += ": ";
+      formatted += key;
+    }
+    if (!detail.empty()) {
+      if (expression || message || typeName || !key.empty()) formatted += ": ";
+      formatted += detail;
+    }
+    if (file) {
+      formatted += " in ";
+      formatted += file;
+      formatted += ": ";
+      formatted += std::to_string(line);
+      formatted += ": ";
+      formatted += function;
+    }
+  } catch (std::bad_alloc&) {
+    formatted.clear();
+    return "Squirrel VM error";
+  }
+  return formatted.c_str();
+}
+
 const char* VM::valueTypeName(SQInteger idx) const {
   SQVM_CTOPG;
-  switch (sq_gettype(vm, idx)) {
+  return typeName(sq_gettype(vm, idx));
+}
+
+const char* VM::typeName(SQObjectType type) {
+  switch (type) {
   case OT_NULL:          return "null";
   case OT_INTEGER:       return "integer";
   case OT_FLOAT:         return "float";
@@ -46,45 +114,779 @@ const char* VM::valueTypeName(SQInteger idx) const {
   }
 }
 
-std::string VM::toString(int idx) const {
+namespace {
+
+class StringSink: public VM::Sink {
+public:
+  explicit StringSink(std::string& out): out(out) {}
+  void write(const char* data, size_t size) override { out.append(data, size); }
+
+private:
+  std::string& out;
+};
+
+// Containers are walked with sq_next on an explicit frame stack, the
+// Squirrel stack only holds one container, iterator, key and value at a
+// time. Output goes through a fixed buffer.
+class Serializer {
+public:
+  Serializer(const VM* vm, VM::Sink& sink, VM::StringFormat format)
+      : vm(vm), v(vm->handle()), sink(sink), format(format) {}
+  ~Serializer() {
+    for (Frame& frame: stack)
+      sq_release(v, &frame.container);
+  }
+
+  void run(SQInteger idx) {
+    value(idx, false);
+    while (!stack.empty()) {
+      Frame& frame = stack.back();
+      sq_pushobject(v, frame.container);
+      sq_pushobject(v, frame.iterator);
+      if (!SQ_SUCCEEDED(sq_next(v, -2))) {
+        sq_pop(v, 2);
+        close();
+        continue;
+      }
+      sq_getstackobj(v, -3, &frame.iterator);
+      if (frame.count++) put(',');
+      if (format == VM::REPL) indent();
+      if (!frame.isArray) {
+        key(sq_gettop(v) - 1);
+        if (format == VM::REPL) put(" = ", 3);
+        else put(':');
+      }
+      // May push a frame, frame is not valid below
+      value(sq_gettop(v), true);
+      sq_pop(v, 4);
+    }
+    flush();
+  }
+
+private:
+  struct Frame {
+    HSQOBJECT container;
+    HSQOBJECT iterator;
+    bool isArray;
+    size_t count;
+  };
+
+  void value(SQInteger idx, bool nested) {
+    char number[64];
+    switch (sq_gettype(v, idx)) {
+    case OT_NULL:
+      put("null", 4);
+      break;
+    case OT_INTEGER: {
+      SQInteger i;
+      sq_getinteger(v, idx, &i);
+      put(number, std::snprintf(number, sizeof(number), "%lld", static_cast<long long>(i)));
+      break;
+    }
+    case OT_FLOAT: {
+      SQFloat f;
+      sq_getfloat(v, idx, &f);
+      if (format == VM::JSON) {
+        if (std::isfinite(f))
+          put(number, jsonFloat(number, sizeof(number), f));
+        else
+          put("null", 4);
+      } else {
+        put(number, std::snprintf(number, sizeof(number), "%g", static_cast<double>(f)));
+      }
+      break;
+    }
+    case OT_BOOL: {
+      SQBool b;
+      sq_getbool(v, idx, &b);
+      if (b) put("true", 4);
+      else put("false", 5);
+      break;
+    }
+    case OT_STRING: {
+      const SQChar* str;
+      SQInteger size;
+      sq_getstringandsize(v, idx, &str, &size);
+      if (nested || (format == VM::JSON)) quoted(str, size);
+      else put(str, size);
+      break;
+    }
+    case OT_ARRAY:
+    case OT_TABLE:
+      open(idx);
+      break;
+    default:
+      converted(idx, format == VM::JSON);
+    }
+  }
+
+  void key(SQInteger idx) {
+    const SQObjectType type = sq_gettype(v, idx);
+    if ((type == OT_ARRAY) || (type == OT_TABLE)) {
+      converted(idx, format == VM::JSON);
+      return;
+    }
+    if (format == VM::REPL) {
+      if (type == OT_STRING) {
+        const SQChar* str;
+        SQInteger size;
+        sq_getstringandsize(v, idx, &str, &size);
+        put(str, size);
+      } else {
+        value(idx, true);
+      }
+      return;
+    }
+    // JSON keys are always strings
+    if (type == OT_STRING) {
+      const SQChar* str;
+      SQInteger size;
+      sq_getstringandsize(v, idx, &str, &size);
+      quoted(str, size);
+    } else {
+      converted(idx, true);
+    }
+  }
+
+  // Floats keep a fraction or an exponent so they read back as floats, and
+  // '.' whatever the locale's decimal point is
+  static int jsonFloat(char* number, size_t capacity, SQFloat f) {
+    int size = std::snprintf(number, capacity, "%.17g", static_cast<double>(f));
+    bool exact = true;
+    for (int i = 0; i < size; ++i) {
+      const char c = number[i];
+      if ((c == 'e') || (c == 'E')) {
+        exact = false;
+      } else if (((c < '0') || (c > '9')) && (c != '-') && (c != '+')) {
+        number[i] = '.';
+        exact = false;
+      }
+    }
+    if (exact) {
+      number[size++] = '.';
+      number[size++] = '0';
+    }
+    return size;
+  }
+
+  void open(SQInteger idx) {
+    Frame frame;
+    sq_getstackobj(v, idx, &frame.container);
+    if (!openContainers.insert(frame.container._unVal.pRefCounted).second) {
+      if (format == VM::JSON) put("null", 4);
+      else put("<cycle>", 7);
+      return;
+    }
+    sq_addref(v, &frame.container);
+    sq_resetobject(&frame.iterator);
+    frame.isArray = sq_isarray(frame.container);
+    frame.count = 0;
+    stack.push_back(frame);
+    put(frame.isArray? '[': '{');
+  }
+
+  void close() {
+    Frame& frame = stack.back();
+    const bool isArray = frame.isArray;
+    const bool empty = (frame.count == 0);
+    openContainers.erase(frame.container._unVal.pRefCounted);
+    sq_release(v, &frame.container);
+    stack.pop_back();
+    if ((format == VM::REPL) && !empty) indent();
+    put(isArray? ']': '}');
+  }
+
+  // Anything else goes through sq_tostring (and _tostring metamethods)
+  void converted(SQInteger idx, bool quote) {
+    if (!SQ_SUCCEEDED(sq_tostring(v, idx)))
+      throw VM::Error(vm, idx, VM::Error::Static("Can't convert to string"), vm->valueTypeName(idx));
+    const SQChar* str;
+    SQInteger size;
+    sq_getstringandsize(v, -1, &str, &size);
+    if (quote) quoted(str, size);
+    else put(str, size);
+    sq_pop(v, 1);
+  }
+
+  void quoted(const SQChar* str, SQInteger size) {
+    static const char hex[] = "0123456789abcdef";
+    put('"');
+    SQInteger run = 0;
+    for (SQInteger i = 0; i < size; ++i) {
+      const unsigned char c = str[i];
+      if ((c >= 0x20) && (c != '"') && (c != '\\')) continue;
+      put(str + run, i - run);
+      run = i + 1;
+      put('\\');
+      switch (c) {
+      case '"':  put('"'); break;
+      case '\\': put('\\'); break;
+      case '\n': put('n'); break;
+      case '\r': put('r'); break;
+      case '\t': put('t'); break;
+      case '\b': put('b'); break;
+      case '\f': put('f'); break;
+      default:
+        put("u00", 3);
+        put(hex[c >> 4]);
+        put(hex[c & 0xf]);
+      }
+    }
+    put(str + run, size - run);
+    put('"');
+  }
+
+  void indent() {
+    put('\n');
+    for (size_t i = 0; i < stack.size(); ++i)
+      put("  ", 2);
+  }
+
+  inline void put(char c) {
+    if (used == sizeof(buffer)) flush();
+    buffer[used++] = c;
+  }
+
+  void put(const char* data, size_t size) {
+    if (size > sizeof(buffer) - used) {
+      flush();
+      if (size >= sizeof(buffer)) {
+        sink.write(data, size);
+        return;
+      }
+    }
+    std::memcpy(buffer + used, data, size);
+    used += size;
+  }
+
+  void flush() {
+    if (used) sink.write(buffer, used);
+    used = 0;
+  }
+
+  const VM* vm;
+  HSQUIRRELVM v;
+  VM::Sink& sink;
+  VM::StringFormat format;
+  std::vector<Frame> stack;
+  std::unordered_set<const void*> openContainers;
+  char buffer[4096];
+  size_t used = 0;
+};
+
+}
+
+std::string VM::toString(int idx, StringFormat format) const {
+  std::string result;
+  toString(result, idx, format);
+  return result;
+}
+
+void VM::toString(std::string& out, SQInteger idx, StringFormat format) const {
+  StringSink sink(out);
+  toString(sink, idx, format);
+}
+
+void VM::toString(Sink& sink, SQInteger idx, StringFormat format) const {
   SQVM_CTOPG;
-  switch (valueType()) {
-  case OT_ARRAY: {
-    std::ostringstream result("[");
-    const int count = getValueSize(idx);
-    VM* mthis = const_cast<VM*>(this);
-    for (SQInteger i = 0; i < count; ++i) {
-      mthis->pushField(i);
-      result << toString();
-      mthis->pop();
-      if (i < count - 1) result << ", ";
-    }
-    result << ']';
-    return result.str();
-  }
-  case OT_TABLE: {
-    if (idx < 0) --idx;
-    std::ostringstream result("{");
-    VM* mthis = const_cast<VM*>(this);
-    mthis->pushNull();
-    bool first = false;
-    while (mthis->next(idx)) {
-      if (!first) result << ", ";
-      first = false;
-      result << toString(-2);
-      result << '=';
-      result << toString(-1);
-      mthis->pop(2);
-    }
-    mthis->pop();
-    result << '}';
-    return result.str();
-  }
-  default:
-    return getAsString(idx);
+  const SQInteger top = sq_gettop(vm);
+  if (idx < 0) idx += top + 1;
+  try {
+    Serializer(this, sink, format).run(idx);
+  } catch (...) {
+    sq_settop(vm, top);
+    throw;
   }
 }
 
+// Bytecode serialization
+
+namespace {
+
+struct ReadBuffer {
+  const char* data;
+  size_t size;
+  size_t pos;
+};
+
+SQInteger readBuffer(SQUserPointer up, SQUserPointer dest, SQInteger size) {
+  ReadBuffer* buffer = reinterpret_cast<ReadBuffer*>(up);
+  const size_t count = std::min<size_t>(size, buffer->size - buffer->pos);
+  std::memcpy(dest, buffer->data + buffer->pos, count);
+  buffer->pos += count;
+  return count;
+}
+
+SQInteger writeString(SQUserPointer up, SQUserPointer src, SQInteger size) {
+  reinterpret_cast<std::string*>(up)->append(reinterpret_cast<const char*>(src), size);
+  return size;
+}
+
+bool isBytecode(const char* data, size_t size) {
+  unsigned short tag;
+  if (size < sizeof(tag)) return false;
+  std::memcpy(&tag, data, sizeof(tag));
+  return tag == SQ_BYTECODE_STREAM_TAG;
+}
+
+// FNV-1a over file name and source, the file name is a part of debug info
+std::uint64_t contentHash(const char* code, size_t size, const std::string& fileName) {
+  std::uint64_t hash = 14695981039346656037ULL;
+  auto feed = [&hash](const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      hash ^= static_cast<unsigned char>(data[i]);
+      hash *= 1099511628211ULL;
+    }
+  };
+  feed(fileName.c_str(), fileName.size() + 1);
+  feed(code, size);
+  return hash;
+}
+
+// .cnut cache file: header, file name, source, then the closure as
+// sq_writeclosure wrote it
+struct CacheFileHeader {
+  char magic[4];
+  std::uint32_t fileNameSize;
+  std::uint64_t sourceSize;
+};
+
+const char CACHE_FILE_MAGIC[4] = {'S', 'Q', 'C', '1'};
+
+// Offset of the bytecode if the file was compiled from this source, 0 if not
+size_t cachedBytecode(const char* data, size_t size,
+                      const char* code, size_t codeSize, const std::string& fileName) {
+  CacheFileHeader header;
+  if (size < sizeof(header)) return 0;
+  std::memcpy(&header, data, sizeof(header));
+  const char* name = data + sizeof(header);
+  const char* source = name + fileName.size();
+  if ((std::memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) != 0) ||
+      (header.fileNameSize != fileName.size()) || (header.sourceSize != codeSize) ||
+      (size - sizeof(header) < fileName.size() + codeSize) ||
+      (std::memcmp(name, fileName.data(), fileName.size()) != 0) ||
+      (std::memcmp(source, code, codeSize) != 0))
+    return 0;
+  return sizeof(header) + fileName.size() + codeSize;
+}
+
+}
+
+void VM::readClosure(const std::string& data) {
+  readClosure(data.data(), data.size());
+}
+
+void VM::readClosure(const char* data, size_t size) {
+  SQVM_TOPG;
+  ReadBuffer buffer = {data, size, 0};
+  SQVM_ASS(sq_readclosure(vm, &readBuffer, &buffer));
+  g.check(1);
+}
+
+void VM::readClosureFromFile(const std::string& fileName) {
+  MappedFile file;
+  if (!file.open(fileName))
+    throw Error(this, 0, "Can't read file " + fileName);
+  readClosure(file.data(), file.size());
+}
+
+std::string VM::writeClosure() const {
+  SQVM_CTOPG;
+  std::string result;
+  SQVM_ASS(sq_writeclosure(vm, &writeString, &result));
+  return result;
+}
+
+void VM::writeClosureToFile(const std::string& fileName) const {
+  const std::string data = writeClosure();
+  std::ofstream file(fileName, std::ios::binary);
+  if (!file.write(data.data(), data.size()))
+    throw Error(this, 0, "Can't write file " + fileName);
+}
+
+// Compilation
+
+void VM::compile(const std::string& code, const std::string& fileName) {
+  compile(code.data(), code.size(), fileName);
+}
+
+void VM::compile(const char* code, size_t size, const std::string& fileName) {
+  SQVM_TOPG;
+  SQVM_METRIC(COMPILE);
+  const std::uint64_t hash = contentHash(code, size, fileName);
+  auto cached = compileCache.find(hash);
+  if (cached != compileCache.end()) {
+    // A colliding source is compiled and not cached
+    const CompiledCode& entry = cached->second;
+    if ((entry.fileName == fileName) && (entry.source.size() == size) &&
+        (std::memcmp(entry.source.data(), code, size) == 0)) {
+      compileCacheRecent.splice(compileCacheRecent.begin(), compileCacheRecent, entry.recent);
+      sq_pushobject(vm, entry.closure);
+      g.check(1);
+      SQVM_METRIC_OK;
+      return;
+    }
+  }
+
+  std::string cacheFile;
+  if (!bytecodeCacheDir.empty()) {
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx.cnut", static_cast<unsigned long long>(hash));
+    cacheFile = bytecodeCacheDir + '/' + name;
+  }
+
+  bool loaded = false;
+  if (!cacheFile.empty()) {
+    MappedFile file;
+    const size_t offset = file.open(cacheFile)?
+        cachedBytecode(file.data(), file.size(), code, size, fileName): 0;
+    if (offset) {
+      try {
+        readClosure(file.data() + offset, file.size() - offset);
+        loaded = true;
+      } catch (Error&) {
+        // Corrupt bytecode, compile from source
+      }
+    }
+    // Missing files and files of other sources are compiled and replaced
+  }
+  if (!loaded) {
+    SQVM_ASS(sq_compilebuffer(vm, code, size, fileName.c_str(), SQTrue));
+    if (!cacheFile.empty()) writeCacheFile(cacheFile, code, size, fileName);
+  }
+
+  if (compileCacheLimit && (cached == compileCache.end())) {
+    trimCompileCache(compileCacheLimit - 1);
+    CompiledCode entry;
+    entry.fileName = fileName;
+    entry.source.assign(code, size);
+    compileCacheRecent.push_front(hash);
+    entry.recent = compileCacheRecent.begin();
+    try {
+      auto added = compileCache.emplace(hash, std::move(entry)).first;
+      sq_getstackobj(vm, -1, &added->second.closure);
+      sq_addref(vm, &added->second.closure);
+    } catch (...) {
+      compileCacheRecent.pop_front();
+      throw;
+    }
+  }
+  g.check(1);
+  SQVM_METRIC_OK;
+}
+
+// Written aside and renamed, so VMs sharing the dir never read a partial
+// file. A cache dir that isn't writable is ignored.
+void VM::writeCacheFile(const std::string& cacheFile, const char* code, size_t size,
+                        const std::string& fileName) const {
+  CacheFileHeader header;
+  std::memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+  header.fileNameSize = static_cast<std::uint32_t>(fileName.size());
+  header.sourceSize = size;
+  std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data += fileName;
+  data.append(code, size);
+  try {
+    data += writeClosure();
+  } catch (Error&) {
+    return;
+  }
+
+  const std::string temp = cacheFile + '.' +
+      std::to_string(reinterpret_cast<std::uintptr_t>(this)) + '.' +
+      std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+  bool written;
+  {
+    std::ofstream file(temp, std::ios::binary);
+    written = static_cast<bool>(file.write(data.data(), data.size()));
+  }
+  if (!written || (std::rename(temp.c_str(), cacheFile.c_str()) != 0))
+    std::remove(temp.c_str());
+}
+
+// Compiles straight from the mapped file
+void VM::compileFile(const std::string& fileName) {
+  MappedFile file;
+  if (!file.open(fileName))
+    throw Error(this, 0, "Can't read file " + fileName);
+  const char* data = file.data();
+  size_t size = file.size();
+  if (isBytecode(data, size)) {
+    readClosure(data, size);
+  } else {
+    // Skip UTF-8 BOM
+    if ((size >= 3) && (std::memcmp(data, "\xEF\xBB\xBF", 3) == 0)) {
+      data += 3;
+      size -= 3;
+    }
+    compile(data, size, fileName);
+  }
+}
+
+void VM::doFile(const std::string& fileName) {
+  SQVM_METRIC(DO_FILE);
+  const int top = getTop();
+  compileFile(fileName);
+  pushRootTable();
+  call(1, false);
+  setTop(top);
+  SQVM_METRIC_OK;
+}
+
+// Blobs
+
+void VM::pushBlob(void* data, size_t size, bool writable, BlobRelease release) {
+  SQVM_TOPG;
+  pushExternalBlob(vm, new ExternalBlob(data, size, writable, std::move(release)));
+  g.check(1);
+}
+
+void VM::pushMappedFile(const std::string& fileName, bool writable) {
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+  if (!file->open(fileName, writable))
+    throw Error(this, 0, "Can't map file " + fileName);
+  // The mapping lives as long as the release callback
+  pushBlob(file->data(), file->size(), writable, [file](void*, size_t) {});
+}
+
+VM::Blob VM::getBlob(SQInteger idx) const {
+  SQVM_CTOPG;
+  Blob result;
+  SQUserPointer p;
+  if (SQ_SUCCEEDED(sqstd_getblob(vm, idx, &p))) {
+    result.data = p;
+    result.size = sqstd_getblobsize(vm, idx);
+    result.writable = true;
+  } else if (SQ_SUCCEEDED(sq_getinstanceup(vm, idx, &p, detail::typeTag<ExternalBlob>())) && p) {
+    const ExternalBlob* blob = reinterpret_cast<const ExternalBlob*>(p);
+    result.data = blob->data;
+    result.size = blob->size;
+    result.writable = blob->writable;
+  } else {
+    throw Error(this, idx, Error::Static("Expected blob"), valueTypeName(idx));
+  }
+  return result;
+}
+
+void VM::setCompileCacheLimit(size_t limit) {
+  compileCacheLimit = limit;
+  trimCompileCache(limit);
+}
+
+void VM::setBytecodeCacheDir(const std::string& dir) {
+  bytecodeCacheDir = dir;
+}
+
+void VM::clearCompileCache() {
+  SQVM_ALLOC;
+  for (auto& item: compileCache)
+    sq_release(vm, &item.second.closure);
+  compileCache.clear();
+  compileCacheRecent.clear();
+}
+
+// Drops the least recently used closures
+void VM::trimCompileCache(size_t size) {
+  SQVM_ALLOC;
+  while (compileCache.size() > size) {
+    auto lru = compileCache.find(compileCacheRecent.back());
+    sq_release(vm, &lru->second.closure);
+    compileCache.erase(lru);
+    compileCacheRecent.pop_back();
+  }
+}
+
+// Pristine state
+
+static bool isContainer(SQObjectType type) {
+  return (type == OT_TABLE) || (type == OT_ARRAY) || (type == OT_CLASS) || (type == OT_INSTANCE);
+}
+
+static bool sameObject(const HSQOBJECT& a, const HSQOBJECT& b) {
+  return (a._type == b._type) && (a._unVal.raw == b._unVal.raw);
+}
+
+// Pushes a copy of the contents of the container on top, class and
+// instance members go to a table
+static void copyContents(HSQUIRRELVM v) {
+  const SQObjectType type = sq_gettype(v, -1);
+  if ((type == OT_TABLE) || (type == OT_ARRAY)) {
+    sq_clone(v, -1);
+    return;
+  }
+  sq_newtable(v);
+  sq_pushnull(v);
+  while (SQ_SUCCEEDED(sq_next(v, -3)))
+    sq_newslot(v, -4, SQFalse);
+  sq_pop(v, 1);
+}
+
+// Whether the member named by the key under the value on top of the stack
+// already has that value
+static bool hasMember(HSQUIRRELVM v, SQInteger idx) {
+  HSQOBJECT value;
+  HSQOBJECT current;
+  sq_getstackobj(v, -1, &value);
+  sq_push(v, -2);
+  if (!SQ_SUCCEEDED(sq_rawget(v, idx))) return false;
+  sq_getstackobj(v, -1, &current);
+  sq_pop(v, 1);
+  return sameObject(value, current);
+}
+
+// False if the container can't be restored: members added to a class
+// can't be removed, fields of a class with instances can't be set
+static bool restoreContents(HSQUIRRELVM v, const HSQOBJECT& container, const HSQOBJECT& contents) {
+  bool restored = true;
+  sq_pushobject(v, container);
+  const SQInteger idx = sq_gettop(v);
+  if (container._type == OT_TABLE) {
+    sq_clear(v, idx);
+  } else if (container._type == OT_ARRAY) {
+    sq_arrayresize(v, idx, 0);
+  }
+  sq_pushobject(v, contents);
+  sq_pushnull(v);
+  while (SQ_SUCCEEDED(sq_next(v, idx + 1))) {
+    if (container._type == OT_TABLE) {
+      sq_newslot(v, idx, SQFalse);
+      continue;
+    }
+    if (container._type == OT_ARRAY) {
+      sq_arrayappend(v, idx);
+      sq_pop(v, 1);
+      continue;
+    }
+    // Members are only set when changed, methods of instances can't be.
+    // Methods set on a derived class are stored as clones.
+    if (!hasMember(v, idx)) {
+      const bool method = (sq_gettype(v, -1) == OT_CLOSURE);
+      sq_push(v, -2);
+      sq_push(v, -2);
+      sq_rawset(v, idx);
+      sq_settop(v, idx + 4);
+      if (!method && !hasMember(v, idx)) restored = false;
+    }
+    sq_pop(v, 2);
+  }
+  if (container._type == OT_CLASS) {
+    SQInteger members = 0;
+    sq_pushnull(v);
+    while (SQ_SUCCEEDED(sq_next(v, idx))) {
+      ++members;
+      sq_pop(v, 2);
+    }
+    if (members != sq_getsize(v, idx + 1)) restored = false;
+  }
+  sq_settop(v, idx - 1);
+  return restored;
+}
+
+void VM::markPristine() {
+  SQVM_TOPG;
+  releasePristine();
+  std::vector<HSQOBJECT> pending(2);
+  sq_pushroottable(vm);
+  sq_getstackobj(vm, -1, &pending[0]);
+  sq_pushconsttable(vm);
+  sq_getstackobj(vm, -1, &pending[1]);
+  sq_pop(vm, 2);
+
+  // Everything reachable from root and consts through containers, so
+  // nested tables like math and string are restored too
+  std::unordered_set<void*> seen;
+  while (!pending.empty()) {
+    PristineContainer item;
+    item.container = pending.back();
+    pending.pop_back();
+    if (!seen.insert(item.container._unVal.pRefCounted).second) continue;
+    sq_pushobject(vm, item.container);
+    copyContents(vm);
+    sq_getstackobj(vm, -1, &item.contents);
+    sq_pushnull(vm);
+    while (SQ_SUCCEEDED(sq_next(vm, -2))) {
+      HSQOBJECT value;
+      sq_getstackobj(vm, -1, &value);
+      if (isContainer(value._type)) pending.push_back(value);
+      sq_pop(vm, 2);
+    }
+    sq_pop(vm, 1);
+    if (item.container._type == OT_CLASS) sq_getbase(vm, -2);
+    else if (item.container._type == OT_INSTANCE) sq_getclass(vm, -2);
+    else sq_pushnull(vm);
+    HSQOBJECT owner;
+    sq_getstackobj(vm, -1, &owner);
+    if (owner._type == OT_CLASS) pending.push_back(owner);
+    sq_addref(vm, &item.container);
+    sq_addref(vm, &item.contents);
+    pristine.push_back(item);
+    sq_pop(vm, 3);
+  }
+  pristineTop = getTop();
+}
+
+void VM::resetToPristine() {
+  if (pristineTop < 0)
+    throw Error(this, 0, Error::Static("resetToPristine() called before markPristine()"));
+  SQVM_ALLOC;
+  if (sq_getvmstate(vm) == SQ_VMSTATE_SUSPENDED)
+    throw Error(this, 0, Error::Static("Can't reset a suspended VM"));
+  sq_settop(vm, pristineTop);
+  sq_reseterror(vm);
+  bool restored = true;
+  // Instances last, their methods come from the restored classes
+  for (int pass = 0; pass < 2; ++pass) {
+    for (const PristineContainer& item: pristine) {
+      if ((item.container._type == OT_INSTANCE) == (pass == 1))
+        restored = restoreContents(vm, item.container, item.contents) && restored;
+    }
+  }
+  // Failed lookups leave an error behind
+  sq_reseterror(vm);
+  if (!restored)
+    throw Error(this, 0, Error::Static("Classes were changed in ways resetToPristine() can't undo"));
+}
+
+void VM::loadSnapshot(const std::string& fileName) {
+  MappedFile file;
+  if (!file.open(fileName))
+    throw Error(this, 0, "Can't read snapshot " + fileName);
+  loadSnapshot(file.data(), file.size());
+}
+
+void VM::loadSnapshot(const char* data, size_t size) {
+  SQVM_TOPG;
+  restoreSnapshot(*this, data, size);
+  g.check(0);
+}
+
+void VM::releasePristine() {
+  for (PristineContainer& item: pristine) {
+    sq_release(vm, &item.container);
+    sq_release(vm, &item.contents);
+  }
+  pristine.clear();
+  pristineTop = -1;
+}
+
+static void debugHookFunc(
+              HSQUIRRELVM v,
+              SQInteger type,
+              const SQChar* source,
+              SQInteger line,
+              const SQChar* function) {
+  VM* vm = VM::inst(v);
+  if (vm->debugHandler)
+    vm->debugHandler->onSqDebugEvent(vm, type, source, line, function);
+}
+
+void VM::setDebugHandler(DebugHandler* handler) {
+  DebugHandler* previous = debugHandler;
+  debugHandler = handler;
+  sq_setnativedebughook(vm, handler? &debugHookFunc: nullptr);
+  if (previous && (previous != handler)) previous->onSqDebugDetached(this);
+}
+
 static void compileErrorFunc(
               HSQUIRRELVM v,
               const SQChar* desc,
@@ -96,35 +898,87 @@ static void compileErrorFunc(
     vm->printHandler->onSqCompileError(vm, desc, source, line, column);
 }
 
+namespace {
+
+// Formats into a per thread buffer that keeps its capacity, a handler
+// printing from its callback gets a buffer of its own
+class FormatBuffer {
+public:
+  FormatBuffer(): buffer(1024, '\0') {}
+
+  template <typename F>
+  static void format(const SQChar* s, va_list vl, F deliver) {
+    // print() and most library messages come as "%s"
+    if ((s[0] == '%') && (s[1] == 's') && (s[2] == '\0')) {
+      const SQChar* str = va_arg(vl, const SQChar*);
+      deliver(str, std::strlen(str));
+      return;
+    }
+    if (depth > 0) {
+      FormatBuffer nested;
+      nested.run(s, vl, deliver);
+      return;
+    }
+    static thread_local FormatBuffer shared;
+    Depth guard;
+    shared.run(s, vl, deliver);
+  }
+
+private:
+  struct Depth {
+    Depth() { ++depth; }
+    ~Depth() { --depth; }
+  };
+
+  template <typename F>
+  void run(const SQChar* s, va_list vl, F deliver) {
+    va_list copy;
+    va_copy(copy, vl);
+    const int size = std::vsnprintf(&buffer[0], buffer.size(), s, vl);
+    // Only messages longer than any before are formatted twice
+    if ((size >= 0) && (size_t(size) >= buffer.size())) {
+      buffer.resize(size + 1);
+      std::vsnprintf(&buffer[0], buffer.size(), s, copy);
+    }
+    va_end(copy);
+    if (size >= 0) deliver(buffer.data(), size_t(size));
+  }
+
+  static thread_local int depth;
+  std::string buffer;
+};
+
+thread_local int FormatBuffer::depth = 0;
+
+}
+
 static void printFunc(HSQUIRRELVM v, const SQChar* s, ...) {
-  va_list vl, vlCopy;
+  VM* vm = VM::inst(v);
+  if (!vm->printHandler) return;
+  va_list vl;
   va_start(vl, s);
-  va_copy(vlCopy, vl);
-  const size_t size = std::vsnprintf(nullptr, 0, s, vl) + 1;
-  std::string message(size, ' ');
-  std::vsnprintf(&message.front(), size, s, vlCopy);
+  FormatBuffer::format(s, vl, [vm](const char* data, size_t size) {
+    vm->printHandler->onSqPrintData(vm, data, size);
+  });
   va_end(vl);
-  va_end(vlCopy);
-
-  VM* vm = VM::inst(v);
-  if (vm->printHandler) vm->printHandler->onSqPrint(vm, message);
 }
 
 static void errorFunc(HSQUIRRELVM v, const SQChar* s, ...) {
-  va_list vl, vlCopy;
+  VM* vm = VM::inst(v);
+  if (!vm->printHandler) return;
+  va_list vl;
   va_start(vl, s);
-  va_copy(vlCopy, vl);
-  const size_t size = std::vsnprintf(nullptr, 0, s, vl) + 1;
-  std::string message(size, ' ');
-  std::vsnprintf(&message.front(), size, s, vlCopy);
+  FormatBuffer::format(s, vl, [vm](const char* data, size_t size) {
+    vm->printHandler->onSqErrorData(vm, data, size);
+  });
   va_end(vl);
-  va_end(vlCopy);
-
-  VM* vm = VM::inst(v);
-  if (vm->printHandler) vm->printHandler->onSqError(vm, message);
 }
 
-VM::VM(PrintHandler* handler, SQInteger initialStackSize): noTopGuard(false), printHandler(handler) {
+VM::VM(PrintHandler* handler, SQInteger initialStackSize, Allocator* allocator,
+       const std::string& snapshotFile)
+    : printHandler(handler), allocator(allocator), noTopGuard(false) {
+  // Also rejects an allocator in builds without SQVM_CUSTOM_ALLOCATOR
+  Allocator::Scope allocatorScope(allocator);
   vm = sq_open(initialStackSize);
   sq_setforeignptr(vm, this);
 
@@ -140,6 +994,29 @@ VM::VM(PrintHandler* handler, SQInteger initialStackSize): noTopGuard(false), pr
   SQVM_ASS(sqstd_register_stringlib(vm));
   SQVM_ASS(sqstd_register_systemlib(vm));
   SQVM_ASS(sqstd_register_bloblib(vm));
+  SQVM_ASS(registerExternalBlobLib(vm));
+  SQVM_ASS(registerJsonLib(vm));
+
+  if (!snapshotFile.empty()) {
+    // The destructor won't run for a throwing constructor
+    try {
+      loadSnapshot(snapshotFile);
+    } catch (...) {
+      sq_close(vm);
+      throw;
+    }
+  }
+}
+
+VM::VM(VM& parent, SQInteger initialStackSize)
+    : printHandler(parent.printHandler), metrics(parent.metrics), allocator(parent.allocator),
+      noTopGuard(false), parent(&parent) {
+  SQVM_ALLOC;
+  vm = sq_newthread(parent.vm, initialStackSize);
+  sq_getstackobj(parent.vm, -1, &threadObject);
+  sq_addref(parent.vm, &threadObject);
+  sq_pop(parent.vm, 1);
+  sq_setforeignptr(vm, this);
 }
 
 }
@@ -4,16 +4,51 @@
 #include <set>
 #include <stdexcept>
 #include <type_traits>
-#include <boost/format.hpp>
 #include <cassert>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "squirrel.h"
 #include "sqstdio.h"
+#include "sq_allocator.h"
+#include "sq_metrics.h"
 
-#define SQVM_TOPG TopGuard g(this, true, __FILE__, __LINE__, __FUNCTION__)
-#define SQVM_LTOPG TopGuard g(this, false, __FILE__, __LINE__, __FUNCTION__)
-#define SQVM_CTOPG CTopGuard g(this, __FILE__, __LINE__, __FUNCTION__)
-#define SQVM_ASS(expr) if (!SQ_SUCCEEDED(expr)) throw sq::VM::Error(this, 0, (boost::format("%1% failed in %2%: %3%: %4%") % #expr % __FILE__ % __LINE__ % __FUNCTION__).str())
+// The VM's allocator is current while a wrapper runs
+#ifdef SQVM_CUSTOM_ALLOCATOR
+#define SQVM_ALLOC Allocator::Scope allocatorScope(allocator)
+#define SQVM_REF_ALLOC Allocator::Scope allocatorScope(vm? vm->allocator: nullptr)
+#else
+#define SQVM_ALLOC
+#define SQVM_REF_ALLOC
+#endif
+#define SQVM_TOPG SQVM_ALLOC; TopGuard g(this, true, __FILE__, __LINE__, __FUNCTION__)
+#define SQVM_LTOPG SQVM_ALLOC; TopGuard g(this, false, __FILE__, __LINE__, __FUNCTION__)
+#define SQVM_CTOPG SQVM_ALLOC; CTopGuard g(this, true, __FILE__, __LINE__, __FUNCTION__)
+#define SQVM_ASS(expr) if (!SQ_SUCCEEDED(expr)) throw sq::VM::Error(this, 0, #expr, __FILE__, __LINE__, __FUNCTION__)
+#ifdef SQVM_METRICS
+#define SQVM_METRIC(op) \
+  if (metrics) metrics->recordStackTop(sq_gettop(vm)); \
+  Metrics::Scope metricScope(metrics, Metrics::op)
+#define SQVM_METRIC_OK metricScope.succeeded()
+#define SQVM_NATIVE_METRIC(v) \
+  Metrics* nativeMetrics = VM::inst(v)? VM::inst(v)->metrics: nullptr; \
+  if (nativeMetrics) nativeMetrics->recordStackTop(sq_gettop(v)); \
+  Metrics::Scope metricScope(nativeMetrics, Metrics::NATIVE_CALL)
+#define SQVM_NATIVE_RETURN(value) return metricScope.result(value)
+#define SQVM_COUNT_ERROR(vm) if ((vm) && (vm)->metrics) (vm)->metrics->recordError()
+#else
+#define SQVM_METRIC(op)
+#define SQVM_METRIC_OK
+#define SQVM_NATIVE_METRIC(v)
+#define SQVM_NATIVE_RETURN(value) return (value)
+#define SQVM_COUNT_ERROR(vm)
+#endif
 
 namespace sq {
 
@@ -34,7 +69,10 @@ public:
     SQUnsignedInteger freeVars;
   };
   
+  class AnyRef;
   class Any;
+  class FieldHandle;
+  class StringView;
   
   enum State {
     IDLE = SQ_VMSTATE_IDLE,
@@ -42,10 +80,30 @@ public:
     SUSPENDED = SQ_VMSTATE_SUSPENDED
   };
 
+  enum StringFormat {
+    REPL,  // indented, top level strings unquoted
+    JSON   // compact, values JSON has no type for are strings
+  };
+
+  // Output of the streaming toString
+  class Sink {
+  public:
+    virtual ~Sink() {}
+    virtual void write(const char* data, size_t size) = 0;
+  };
+
+  // The VM calls the Data variants with the formatted text, valid for the
+  // call only; by default they pass a string to onSqPrint/onSqError.
   class PrintHandler {
   public:
-    virtual void onSqPrint(VM* vm, const std::string& message) = 0;
-    virtual void onSqError(VM* vm, const std::string& message) = 0;
+    virtual void onSqPrint(VM* vm, const std::string& message) {}
+    virtual void onSqError(VM* vm, const std::string& message) {}
+    virtual void onSqPrintData(VM* vm, const char* data, size_t size) {
+      onSqPrint(vm, std::string(data, size));
+    }
+    virtual void onSqErrorData(VM* vm, const char* data, size_t size) {
+      onSqError(vm, std::string(data, size));
+    }
     virtual void onSqCompileError(
                    VM* vm,
                    const std::string& desc,
@@ -54,11 +112,38 @@ public:
                    SQInteger column) = 0;
   };
 
+  class DebugHandler {
+  public:
+    // type is 'c' (call), 'r' (return) or 'l' (line)
+    virtual void onSqDebugEvent(
+                   VM* vm,
+                   SQInteger type,
+                   const SQChar* source,
+                   SQInteger line,
+                   const SQChar* function) = 0;
+    // The handler was replaced or the VM is being destroyed
+    virtual void onSqDebugDetached(VM* vm) {}
+  };
+
   VM(const VM&) = delete;
-  VM(PrintHandler* handler = nullptr, SQInteger initialStackSize = 1024);
-  virtual ~VM() { sq_close(vm); }
+  // The allocator (if any) is made current on the calling thread while the
+  // VM's wrappers run and must outlive the VM. A snapshot file (see
+  // SnapshotWriter) is restored into the root table.
+  VM(PrintHandler* handler = nullptr, SQInteger initialStackSize = 1024,
+     Allocator* allocator = nullptr, const std::string& snapshotFile = std::string());
+  virtual ~VM() {
+    SQVM_ALLOC;
+    if (debugHandler) debugHandler->onSqDebugDetached(this);
+    clearCompileCache();
+    releasePristine();
+    if (parent)
+      sq_release(parent->vm, &threadObject);
+    else
+      sq_close(vm);
+  }
   
   State getState() const;
+  inline Allocator* getAllocator() const { return allocator; }
   
   // Simple API wrappers
   // Stack Operations
@@ -73,19 +158,22 @@ public:
   // Object creation and handling
   void bindEnv(SQInteger idx);
   void pushInstance(SQInteger idx = -1);
-  // sq_getbyhandle -
   ClosureInfo getClosureInfo(SQInteger idx = -1) const;
   std::string getClosureName(SQInteger idx = -1) const;
   // sq_gethash -
   template <typename T = void*>
   T getInstancePtr(SQInteger ind = -1, void* typeTag = nullptr) const;
-  // sq_getmemberhandle -
+  // Member handle for classes and instances of them, a referenced key
+  // for anything else. pushField(handle) and get*Field(handle) use it.
+  template <typename Key>
+  FieldHandle getFieldHandle(Key key, SQInteger idx = -1) const;
   // sq_getscratchpad -
   inline int getValueSize(SQInteger idx = -1) const { return sq_getsize(vm, idx); }
   // sq_getthread -
   inline SQObjectType valueType(SQInteger idx = -1) const { return sq_gettype(vm, idx); }
   const char* valueTypeName(SQInteger idx = -1) const;
-  // sq_gettypetag -
+  static const char* typeName(SQObjectType type);
+  void* getTypeTag(SQInteger idx = -1) const;
   template <typename T = void*>
   T getUserData(SQInteger idx = -1) const;
   template <typename T = void*>
@@ -99,11 +187,14 @@ public:
   void pushUserValue(Ts ... args);
   void pushNull();
   void pushPtr(const void* ptr);
-  // sq_setbyhandle -
+  // Value on top, pops it
+  void setByHandle(const FieldHandle& field, SQInteger idx = -2);
+  template <typename Value>
+  void setByHandle(const FieldHandle& field, Value value, SQInteger idx = -1);
   void setClassUDSize(SQInteger size, SQInteger idx = -1);
   void setInstancePtr(void* ptr, SQInteger idx = -1);
   void setReleaseHook(SQRELEASEHOOK f, SQInteger idx = -1);
-  // sq_settypetag -
+  void setTypeTag(void* typeTag, SQInteger idx = -1);
   void pushTypeOf(SQInteger idx = -1);
   
   // Calls
@@ -112,7 +203,10 @@ public:
   void pushLastError();
   // sq_getlocal
   void resetError();
-  // sq_resume
+  // Installs the native debug hook, null removes it
+  void setDebugHandler(DebugHandler* handler);
+  void resume(bool ret);
+  SQInteger suspend();
   SQInteger throwError(const std::string& msg);
   SQInteger throwError(const char* msg);
   SQInteger throwObject();
@@ -157,14 +251,22 @@ public:
   // sq_weakref -
   
   // Bytecode serialization
-  // sq_readclosure -
-  // sq_writeclosure -
+  void readClosure(const std::string& data);
+  void readClosure(const char* data, size_t size);
+  void readClosureFromFile(const std::string& fileName);
+  std::string writeClosure() const;
+  void writeClosureToFile(const std::string& fileName) const;
   
   // Raw object handling
   
   // Garbage Collector
-  // sq_collectgarbage -
-  // sq_resurrectunreachable
+  // Only reference cycles are left for the collector, it runs when called
+  // (see GarbageCollector for scheduling). Both fail when squirrel is built
+  // with NO_GARBAGE_COLLECTOR: collectGarbage returns -1.
+  SQInteger collectGarbage();
+  // Pushes an array of the unreachable objects (null if there are none)
+  // instead of freeing them
+  bool resurrectUnreachable();
   
   // Additional API
 
@@ -173,30 +275,35 @@ public:
   // int  
   SQInteger getInt(SQInteger idx = -1) const;
   template <typename Key>
-  SQInteger getIntField(Key key, SQInteger idx = -1) const;
+  SQInteger getIntField(const Key& key, SQInteger idx = -1) const;
   VM& operator >> (SQInteger& data);
   VM& operator << (SQInteger data);
 
   // float
   SQFloat getFloat(SQInteger idx = -1) const;
   template <typename Key>
-  SQFloat getFloatField(Key key, SQInteger idx = -1) const;
+  SQFloat getFloatField(const Key& key, SQInteger idx = -1) const;
   VM& operator >> (SQFloat& data);
   VM& operator << (SQFloat data);
 
   // string
+  // Views are valid while the string stays on the stack, for fields use
+  // getField(key).getStringView() to keep the value pinned by the Any.
   std::string getString(SQInteger idx = -1) const;
+  StringView getStringView(SQInteger idx = -1) const;
   std::string getAsString(SQInteger idx = -1) const;
   template <typename Key>
-  std::string getStringField(Key key, SQInteger idx = -1) const;
+  std::string getStringField(const Key& key, SQInteger idx = -1) const;
   VM& operator >> (std::string& data);
   VM& operator << (const std::string& data);
+  VM& operator << (const SQChar* data);
+  VM& operator << (StringView data);
 
   // bool
   bool getBool(SQInteger idx = -1) const;
   bool getAsBool(SQInteger idx = -1) const;
   template <typename Key>
-  bool getBoolField(Key key, SQInteger idx = -1) const;
+  bool getBoolField(const Key& key, SQInteger idx = -1) const;
   VM& operator >> (bool& data);
   VM& operator << (bool data);
 /*
@@ -218,71 +325,265 @@ public:
   // any
   Any get(SQInteger idx = -1) const;
   template <typename Key>
-  Any getField(Key key, SQInteger idx = -1) const;
+  Any getField(const Key& key, SQInteger idx = -1) const;
   VM& operator >> (Any& data);
   VM& operator << (const Any& data);
+  VM& operator << (const AnyRef& data);
+
+  // blob
+  // External memory is pushed without copying (see ExternalBlob),
+  // release(data, size) runs once scripts drop it. getBlob views a std blob
+  // or an external blob in place, valid while the object lives and a std
+  // blob isn't resized.
+  struct Blob {
+    void* data;
+    size_t size;
+    bool writable;
+  };
+  typedef std::function<void(void* data, size_t size)> BlobRelease;
+  void pushBlob(void* data, size_t size, bool writable, BlobRelease release = nullptr);
+  void pushMappedFile(const std::string& fileName, bool writable = false);
+  Blob getBlob(SQInteger idx = -1) const;
+
+  // Containers, converted in one call with presized arrays and tables:
+  // std::vector and std::tuple are arrays, std::map and std::unordered_map
+  // are tables, and they nest. get<T> works for any bindable argument type.
+  template <typename T>
+  void push(const std::vector<T>& data);
+  template <typename K, typename V>
+  void push(const std::map<K, V>& data);
+  template <typename K, typename V>
+  void push(const std::unordered_map<K, V>& data);
+  template <typename ... Ts>
+  void push(const std::tuple<Ts ...>& data);
+  template <typename T>
+  T get(SQInteger idx = -1) const;
 
   
   template <typename Key>
   void pushField(Key field, int idx = -1);
+  void pushField(const FieldHandle& field, int idx = -1);
   
   void pushRootTable();
   void compile(const std::string& code, const std::string& fileName = "repl");
+  void compile(const char* code, size_t size, const std::string& fileName = "repl");
   void exec(const std::string& code, const std::string& fileName = "repl");
+  void compileFile(const std::string& fileName);
   void doFile(const std::string& fileName);
+
+  // Compiled closures are cached by hash of source and file name, so repeated
+  // compile/exec/doFile of the same code is a lookup; a hit is used only if
+  // the source and file name match. If bytecode cache dir is set, compiled
+  // closures are also stored there as .cnut files along with their source
+  // and file name, which must match too. The files are checked, not
+  // authenticated: the dir must be writable by trusted users only.
+  // Beyond the limit (256 by default, 0 disables the cache) the least
+  // recently used closure is dropped to make room for a new one.
+  void setCompileCacheLimit(size_t limit);
+  void setBytecodeCacheDir(const std::string& dir);
+  void clearCompileCache();
+
+  // markPristine() snapshots the contents of root and const tables and of
+  // the tables, arrays, classes and instances reachable from them.
+  // resetToPristine() restores them in place (so compiled closures stay
+  // bound to the same objects) and drops whatever scripts left on the stack.
+  // It throws for a suspended VM and for class changes that can't be undone
+  // (new members, fields of classes that have instances). Userdata and free
+  // variables aren't restored.
+  void markPristine();
+  void resetToPristine();
+
+  // Adds the root slots stored by SnapshotWriter
+  void loadSnapshot(const std::string& fileName);
+  void loadSnapshot(const char* data, size_t size);
   
-  std::string toString(int idx = -1) const;
+  // Serializes arrays and tables without recursion, containers already
+  // being written show up as <cycle> (null in JSON)
+  std::string toString(int idx = -1, StringFormat format = REPL) const;
+  void toString(std::string& out, SQInteger idx = -1, StringFormat format = REPL) const;
+  void toString(Sink& sink, SQInteger idx = -1, StringFormat format = REPL) const;
   
-  class TopGuard;
-  class CTopGuard;
+  // Stack checking policies, SQVM_STACK_TRACE selects the default one
+  struct CheckedStack {};
+  struct UncheckedStack {};
+#ifdef SQVM_STACK_TRACE
+  typedef CheckedStack StackPolicy;
+#else
+  typedef UncheckedStack StackPolicy;
+#endif
+
+  template <typename Policy, bool constant = false>
+  class BasicTopGuard;
+  typedef BasicTopGuard<StackPolicy> TopGuard;
+  typedef BasicTopGuard<StackPolicy, true> CTopGuard;
   
   void setParameterCheck(SQInteger paramCount, const std::string& params);
 
   void pushRawClosure(SQFUNCTION func, SQInteger freeVars = 0);
   template <typename F, F func>
   void pushClosure(SQInteger freeVars = 0);
+
+  // Native bindings with argument types and typemask deduced from signature
+  template <typename F>
+  void pushFunction(F func);
+  template <typename F, F func>
+  void pushFunction();
+  template <typename C, typename R, typename ... Args>
+  void pushMethod(R (C::*method)(Args ...));
+  template <typename C, typename R, typename ... Args>
+  void pushMethod(R (C::*method)(Args ...) const);
   
+  inline HSQUIRRELVM handle() const { return vm; }
+
   static VM* inst(HSQUIRRELVM vm) {
     return reinterpret_cast<VM*>(sq_getforeignptr(vm));
   }
 
   PrintHandler* printHandler;
+  DebugHandler* debugHandler = nullptr;
+  // Recorded into only with SQVM_METRICS, threads inherit it from the parent
+  Metrics* metrics = nullptr;
 
 private:
   
+  Allocator* allocator;
   HSQUIRRELVM vm;
   bool noTopGuard;
+
+  struct CompiledCode {
+    HSQOBJECT closure;
+    std::string fileName;
+    std::string source;
+    std::list<std::uint64_t>::iterator recent;
+  };
+  std::unordered_map<std::uint64_t, CompiledCode> compileCache;
+  std::list<std::uint64_t> compileCacheRecent;  // most recently used first
+  size_t compileCacheLimit = 256;
+  void trimCompileCache(size_t size);
+  std::string bytecodeCacheDir;
+  void writeCacheFile(const std::string& cacheFile, const char* code, size_t size,
+                      const std::string& fileName) const;
+
+  // Whether the class at idx, or the class of the instance there, is the
+  // class of the member handle or derives from it
+  bool fitsHandle(const FieldHandle& field, SQInteger idx) const;
+
+  void releasePristine();
+  struct PristineContainer {
+    HSQOBJECT container;
+    HSQOBJECT contents;
+  };
+  std::vector<PristineContainer> pristine;
+  SQInteger pristineTop = -1;
+
+  VM* parent = nullptr;
+  HSQOBJECT threadObject;
+
+protected:
+  // Wraps a new friend thread of parent (see Thread)
+  VM(VM& parent, SQInteger initialStackSize);
 };
 
+// Error keeps the failure as structured fields pointing to static strings,
+// the message is formatted only when what() is called.
 class VM::Error: public std::runtime_error {
 public:
-  Error(const VM* vm, SQInteger idx, const std::string& message)
-    : std::runtime_error("Squirrel VM error: " + message), vm(vm), idx(idx) {
+  // Text with static storage duration, kept by pointer. Other text goes
+  // to the detail constructor, which copies it.
+  struct Static {
+    explicit constexpr Static(const char* text): text(text) {}
+    const char* text;
+  };
+
+  Error(const VM* vm, SQInteger idx, const std::string& detail)
+    : std::runtime_error(std::string()), vm(vm), idx(idx), detail(detail) {
+    SQVM_COUNT_ERROR(vm);
   }
 
+  // typeName is static too, see VM::typeName
+  Error(const VM* vm, SQInteger idx, Static message, const char* typeName = nullptr)
+    : std::runtime_error(std::string()), vm(vm), idx(idx), message(message.text), typeName(typeName) {
+    SQVM_COUNT_ERROR(vm);
+  }
+
+  Error(const VM* vm, SQInteger idx, const char* expression,
+        const char* file, int line, const char* function)
+    : std::runtime_error(std::string()), vm(vm), idx(idx), expression(expression),
+      file(file), line(line), function(function) {
+    SQVM_COUNT_ERROR(vm);
+  }
+
+  const char* what() const noexcept override;
+
   const VM* vm;
   const SQInteger idx;
+  const char* message = nullptr;
+  const char* expression = nullptr;
+  const char* file = nullptr;
+  int line = 0;
+  const char* function = nullptr;
+  const char* typeName = nullptr;
+  std::string key;  // of the field that failed
+  std::string detail;
+
+private:
+  mutable std::string formatted;
 };
 
-#ifdef SQVM_STACK_TRACE
-class VM::TopGuard {
+// Non-owning view of a Squirrel string, keeps its length so embedded
+// NULs are preserved
+class VM::StringView {
 public:
-  TopGuard(VM* vm, bool prevent, const char* file, int line, const char* function)
-      : vm(vm), file(file), line(line), function(function), checked(false)
+  StringView(): ptr(nullptr), length(0) {}
+  StringView(const SQChar* data, size_t size): ptr(data), length(size) {}
+  StringView(const SQChar* data): ptr(data), length(std::char_traits<SQChar>::length(data)) {}
+  StringView(const std::string& data): ptr(data.data()), length(data.size()) {}
+
+  inline const SQChar* data() const { return ptr; }
+  inline size_t size() const { return length; }
+  inline bool empty() const { return length == 0; }
+  inline const SQChar* begin() const { return ptr; }
+  inline const SQChar* end() const { return ptr + length; }
+  inline SQChar operator [] (size_t i) const { return ptr[i]; }
+  inline std::string str() const { return std::string(ptr, length); }
+
+  inline bool operator == (StringView other) const {
+    return (length == other.length) &&
+           (std::char_traits<SQChar>::compare(ptr, other.ptr, length) == 0);
+  }
+  inline bool operator != (StringView other) const { return !(*this == other); }
+
+private:
+  const SQChar* ptr;
+  size_t length;
+};
+
+// Checking guard: verifies that the stack top moved by the expected delta
+template <typename Policy, bool constant>
+class VM::BasicTopGuard {
+public:
+  BasicTopGuard(const VM* vm, bool prevent, const char* file, int line, const char* function)
+      : vm(const_cast<VM*>(vm)), file(file), line(line), function(function), checked(false)
   {
-    oldNt = vm->noTopGuard;
+    oldNt = this->vm->noTopGuard;
     if (prevent)
       this->vm->noTopGuard = true;
-      oldTop = vm->getTop();
+    oldTop = vm->getTop();
   }
 
-  virtual void check(int delta = 0) {
+  void check(int delta = 0) {
+    if (constant && delta)
+      throw std::logic_error("Expecting changing stack by constant operation");
     checked = true;
-    if ((delta != -1) && (vm->getTop() - oldTop != delta))
-      throw Error(vm, vm->getTop(), (boost::format(
-              "SQ VM stack integrity failed: Expexted delta = %1% but got %2% "
-              " in %3%: %4% on line %5%") % delta % (vm->getTop() - oldTop)
-              % file % function % line).str());
+    if ((delta != -1) && (vm->getTop() - oldTop != delta)) {
+      Error error(vm, vm->getTop(), Error::Static("SQ VM stack integrity failed"));
+      error.file = file;
+      error.line = line;
+      error.function = function;
+      error.detail = "Expected delta = " + std::to_string(delta) +
+                     " but got " + std::to_string(vm->getTop() - oldTop);
+      throw error;
+    }
   }
 
   template <typename T>
@@ -291,10 +592,10 @@ public:
     return data;
   }
 
-  ~TopGuard() {
+  ~BasicTopGuard() noexcept(false) {
     vm->noTopGuard = oldNt;
     // TODO: if (!vm->noTopGuard && (vm->getTop() != oldTop))
-    if (!checked) check();
+    if (!checked && !std::uncaught_exception()) check();
   }
 
 protected:
@@ -307,12 +608,13 @@ protected:
   bool checked;
 };
 
-#else
-class VM::TopGuard {
+// Non-checking guard: compiles away completely
+template <bool constant>
+class VM::BasicTopGuard<VM::UncheckedStack, constant> {
 public:
-  TopGuard(VM* vm, bool prevent, const char* file, int line, const char* function) {}
+  BasicTopGuard(const VM* vm, bool prevent, const char* file, int line, const char* function) {}
 
-  virtual void check(int delta = 0) {}
+  inline void check(int delta = 0) {}
 
   template <typename T>
   inline T check(T data, int delta) {
@@ -320,68 +622,116 @@ public:
   }
 };
 
-#endif
-
-class VM::CTopGuard: public VM::TopGuard {
+// Borrowed object: no reference is taken, so it's valid only while the
+// stack slot or the owner it was taken from holds the value. Conversions
+// read the object directly (getString throws for non-strings), get<T>
+// checks the type.
+class VM::AnyRef {
 public:
-  CTopGuard(const VM* vm, const char* file, int line, const char* function)
-    : TopGuard(const_cast<VM*>(vm), true, file, line, function) {}
+  AnyRef() {
+    sq_resetobject(&obj);
+  }
 
-  void check(int delta = 0) override {
-    if (delta) throw std::logic_error("Expecting changing stack by constant operation");
+  AnyRef(VM* v, SQInteger idx = -1): vm(v) {
+    sq_resetobject(&obj);
+    if (vm && !SQ_SUCCEEDED(sq_getstackobj(vm->vm, idx, &obj)))
+      throw Error(vm, idx, Error::Static("Can't get stack object"));
   }
+
+  AnyRef(VM* v, const HSQOBJECT& o): vm(v), obj(o) {}
+
+  inline SQObjectType type() const { return obj._type; }
+  inline bool isNull() const { return obj._type == OT_NULL; }
+
+  SQInteger getInt() const;
+  SQFloat getFloat() const;
+  std::string getString() const;
+  StringView getStringView() const;
+  bool getBool() const;
+  template <typename T>
+  T get() const;
+
+  VM* vm = nullptr;
+  HSQOBJECT obj;
 };
 
-class VM::Any {
+// Owning reference, moves hand the reference over without touching the
+// reference count.
+class VM::Any: public AnyRef {
 public:
-  Any() {
-    sq_resetobject(&obj);
-  }
+  Any() = default;
 
-  Any(VM* v, SQInteger idx = -1) {
-    reset(v, idx);
+  Any(VM* v, SQInteger idx = -1): AnyRef(v, idx) {
+    SQVM_REF_ALLOC;
+    if (vm) sq_addref(vm->vm, &obj);
   }
 
-  void reset(VM* v, SQInteger idx = -1) {
-    if (vm) sq_release(vm->vm, &obj);
-    vm = v;
-    sq_resetobject(&obj);
-    if (!vm) return;
-    if (!SQ_SUCCEEDED(sq_getstackobj(vm->vm, idx, &obj)))
-      throw Error(vm, idx, "Can't get stack object");
-    sq_addref(vm->vm, &obj);
+  explicit Any(const AnyRef& ref): AnyRef(ref) {
+    SQVM_REF_ALLOC;
+    if (vm) sq_addref(vm->vm, &obj);
   }
 
-  Any(const Any& other): vm(other.vm), obj(other.obj)  {
+  Any(const Any& other): AnyRef(other) {
+    SQVM_REF_ALLOC;
     if (vm) sq_addref(vm->vm, &obj);
   }
 
+  Any(Any&& other) noexcept: AnyRef(other) {
+    other.vm = nullptr;
+    sq_resetobject(&other.obj);
+  }
+
   ~Any() {
+    SQVM_REF_ALLOC;
     if (vm) sq_release(vm->vm, &obj);
   }
 
   Any& operator = (const Any& other) {
-    if (this == &other) return *this;
-    if (!other.vm) {
-      if (vm) sq_release(vm->vm, &obj);
-      vm = nullptr;
-      return *this;
+    if (this != &other) Any(other).swap(*this);
+    return *this;
+  }
+
+  Any& operator = (Any&& other) noexcept {
+    if (this != &other) {
+      Any(std::move(other)).swap(*this);
     }
-    assert(!vm || (vm == other.vm));
-    vm = other.vm;
-    sq_release(vm->vm, &obj);
-    obj = other.obj;
-    sq_addref(vm->vm, &obj);
     return *this;
   }
 
-  SQInteger getInt() const;
-  SQFloat getFloat() const;
-  std::string getString() const;
-  bool getBool() const;
+  // The old value is kept if the new one can't be taken
+  void reset(VM* v, SQInteger idx = -1) {
+    Any(v, idx).swap(*this);
+  }
 
-  VM* vm = nullptr;
-  HSQOBJECT obj;
+  void reset() {
+    Any().swap(*this);
+  }
+
+  void swap(Any& other) noexcept {
+    std::swap(vm, other.vm);
+    std::swap(obj, other.obj);
+  }
+
+  friend void swap(Any& a, Any& b) noexcept {
+    a.swap(b);
+  }
+};
+
+// Field access without pushing and hashing a key on every use, see
+// getFieldHandle. Member handles hold a slot index valid for the class,
+// its subclasses and their instances, the class is checked on every use.
+// Table keys stay referenced.
+class VM::FieldHandle {
+public:
+  inline bool isMember() const { return member; }
+
+private:
+  friend class VM;
+
+  bool member = false;
+  HSQMEMBERHANDLE handle;
+  Any owner;  // class of a member handle
+  Any key;
 };
 
 inline VM::State VM::getState() const {
@@ -528,12 +878,24 @@ inline void VM::setReleaseHook(SQRELEASEHOOK f, SQInteger idx) {
   SQVM_TOPG; sq_setreleasehook(vm, idx, f);
 }
 
+inline void* VM::getTypeTag(SQInteger idx) const {
+  SQVM_CTOPG;
+  SQUserPointer v;
+  SQVM_ASS(sq_gettypetag(vm, idx, &v));
+  return v;
+}
+
+inline void VM::setTypeTag(void* typeTag, SQInteger idx) {
+  SQVM_TOPG; SQVM_ASS(sq_settypetag(vm, idx, typeTag));
+}
+
 inline void VM::pushTypeOf(SQInteger idx) {
   SQVM_TOPG; SQVM_ASS(sq_typeof(vm, idx)); g.check(1);
 }
 
 inline void VM::call(SQInteger params, bool ret) {
   SQVM_LTOPG;
+  SQVM_METRIC(CALL);
   if (!SQ_SUCCEEDED(sq_call(vm, params, ret? SQTrue: SQFalse, SQTrue))) {
     sq_getlasterror(vm);
     std::string errorString;
@@ -541,6 +903,7 @@ inline void VM::call(SQInteger params, bool ret) {
     throw Error(this, -1, errorString);
   }
   g.check(-params + (ret? 1: 0));
+  SQVM_METRIC_OK;
 }
 
 inline void VM::pushCallee() {
@@ -555,6 +918,22 @@ inline void VM::resetError() {
   SQVM_TOPG; sq_reseterror(vm);
 }
 
+inline void VM::resume(bool ret) {
+  SQVM_LTOPG;
+  if (!SQ_SUCCEEDED(sq_resume(vm, ret? SQTrue: SQFalse, SQTrue))) {
+    sq_getlasterror(vm);
+    const std::string errorString = getAsString();
+    pop();
+    throw Error(this, -1, errorString);
+  }
+  g.check(ret? 1: 0);
+}
+
+// Only for native closures: return vm->suspend();
+inline SQInteger VM::suspend() {
+  return sq_suspendvm(vm);
+}
+
 inline SQInteger VM::throwError(const std::string& msg) {
   SQVM_TOPG; return sq_throwerror(vm, msg.c_str());
 }
@@ -624,8 +1003,7 @@ inline bool VM::instanceOf() {
 inline void VM::newSlot(SQInteger idx, bool isStatic) {
   SQVM_TOPG;
   if ((valueType(idx) != OT_CLASS) && (valueType(idx) != OT_TABLE))
-    throw Error(this, idx, (boost::format("Can't create slot in value of type %1%")
-                % valueTypeName(idx)).str());
+    throw Error(this, idx, Error::Static("Can't create slot"), valueTypeName(idx));
   SQVM_ASS(sq_newslot(vm, idx, isStatic? SQTrue: SQFalse));
   g.check(-2);
 }
@@ -661,15 +1039,136 @@ inline void VM::setDelegate(SQInteger idx) {
   SQVM_TOPG; sq_setdelegate(vm, idx); g.check(-1);
 }
 
+namespace detail {
+inline std::string keyName(const std::string& key) { return key; }
+inline std::string keyName(const char* key) { return key; }
+inline std::string keyName(VM::StringView key) { return key.str(); }
+inline std::string keyName(const VM::Any& key) { return "<object>"; }
+template <typename Key>
+inline std::string keyName(Key key) { return std::to_string(key); }
+}
+
 template <typename Key>
 inline void VM::pushField(Key field, int idx) {
   SQVM_TOPG;
   if (idx < 0) idx -= 1;
   (*this) << field;
-  if (!SQ_SUCCEEDED(sq_get(vm, idx)))
-    throw Error(this, idx, (boost::format("Can't get field: %1%")
-                % field).str());
+  if (!SQ_SUCCEEDED(sq_get(vm, idx))) {
+    Error error(this, idx, Error::Static("Can't get field"));
+    error.key = detail::keyName(field);
+    throw error;
+  }
+  g.check(1);
+}
+
+inline bool VM::fitsHandle(const FieldHandle& field, SQInteger idx) const {
+  const SQInteger top = sq_gettop(vm);
+  const SQObjectType type = sq_gettype(vm, idx);
+  if (type == OT_INSTANCE) sq_getclass(vm, idx);
+  else if (type == OT_CLASS) sq_push(vm, idx);
+  else return false;
+  // Walks the base chain keeping one class on the stack
+  bool found = false;
+  HSQOBJECT cls;
+  for (;;) {
+    sq_getstackobj(vm, -1, &cls);
+    if (cls._type != OT_CLASS) break;
+    if (cls._unVal.pRefCounted == field.owner.obj._unVal.pRefCounted) {
+      found = true;
+      break;
+    }
+    sq_getbase(vm, -1);
+    sq_remove(vm, -2);
+  }
+  sq_settop(vm, top);
+  return found;
+}
+
+inline void VM::pushField(const FieldHandle& field, int idx) {
+  SQVM_TOPG;
+  if (field.member) {
+    if (!fitsHandle(field, idx))
+      throw Error(this, idx, Error::Static("Member handle of another class"), valueTypeName(idx));
+    if (!SQ_SUCCEEDED(sq_getbyhandle(vm, idx, &field.handle)))
+      throw Error(this, idx, Error::Static("Can't get member by handle"));
+  } else {
+    if (idx < 0) idx -= 1;
+    sq_pushobject(vm, field.key.obj);
+    if (!SQ_SUCCEEDED(sq_get(vm, idx)))
+      throw Error(this, idx, Error::Static("Can't get field by handle"));
+  }
+  g.check(1);
+}
+
+template <typename Key>
+inline VM::FieldHandle VM::getFieldHandle(Key key, SQInteger idx) const {
+  SQVM_CTOPG;
+  VM* mthis = const_cast<VM*>(this);
+  const SQInteger top = getTop();
+  FieldHandle result;
+  const SQObjectType type = valueType(idx);
+  if ((type == OT_CLASS) || (type == OT_INSTANCE)) {
+    if (type == OT_INSTANCE) mthis->pushClassOf(idx);
+    else mthis->push(idx);
+    (*mthis) << key;
+    // Pops the key on success only
+    const bool found = SQ_SUCCEEDED(sq_getmemberhandle(vm, -2, &result.handle));
+    if (found) result.owner.reset(mthis);
+    mthis->setTop(top);
+    if (!found) {
+      Error error(this, idx, Error::Static("No such member"));
+      error.key = detail::keyName(key);
+      throw error;
+    }
+    result.member = true;
+  } else {
+    (*mthis) << key;
+    result.key.reset(mthis);
+    mthis->setTop(top);
+  }
+  return result;
+}
+
+inline void VM::setByHandle(const FieldHandle& field, SQInteger idx) {
+  SQVM_TOPG;
+  if (field.member) {
+    if (!fitsHandle(field, idx))
+      throw Error(this, idx, Error::Static("Member handle of another class"), valueTypeName(idx));
+    if (!SQ_SUCCEEDED(sq_setbyhandle(vm, idx, &field.handle)))
+      throw Error(this, idx, Error::Static("Can't set member by handle"));
+  } else {
+    // sq_set takes the key under the value
+    if (idx < 0) idx -= 2;
+    const SQInteger top = sq_gettop(vm);
+    sq_pushobject(vm, field.key.obj);
+    sq_push(vm, -2);
+    if (!SQ_SUCCEEDED(sq_set(vm, idx))) {
+      sq_settop(vm, top);
+      throw Error(this, idx, Error::Static("Can't set field by handle"));
+    }
+    sq_pop(vm, 1);
+  }
+  g.check(-1);
+}
+
+template <typename Value>
+inline void VM::setByHandle(const FieldHandle& field, Value value, SQInteger idx) {
+  SQVM_TOPG;
+  (*this) << value;
+  setByHandle(field, (idx < 0)? idx - 1: idx);
+  g.check(0);
+}
+
+inline SQInteger VM::collectGarbage() {
+  SQVM_TOPG; const SQInteger result = sq_collectgarbage(vm); g.check(0);
+  return result;
+}
+
+inline bool VM::resurrectUnreachable() {
+  SQVM_TOPG;
+  if (!SQ_SUCCEEDED(sq_resurrectunreachable(vm))) return false;
   g.check(1);
+  return true;
 }
 
 inline void VM::pushRootTable() {
@@ -683,10 +1182,11 @@ inline void VM::pushRawClosure(SQFUNCTION func, SQInteger freeVars) {
 template <typename F, F func>
 inline void VM::pushClosure(SQInteger freeVars) {
   struct Impl {
-    SQInteger call(HSQUIRRELVM v) {
+    static SQInteger call(HSQUIRRELVM v) {
       VM* vm = VM::inst(v);
       try {
-        return func(vm);
+        SQVM_NATIVE_METRIC(v);
+        SQVM_NATIVE_RETURN(func(vm));
       } catch (Error& e) {
         return vm->throwError(e.what());
       }
@@ -695,25 +1195,544 @@ inline void VM::pushClosure(SQInteger freeVars) {
   pushRawClosure(&Impl::call, freeVars);
 }
 
-inline void VM::compile(const std::string& code, const std::string& fileName) {
+inline void VM::setParameterCheck(SQInteger paramCount, const std::string& params) {
+  SQVM_TOPG; SQVM_ASS(sq_setparamscheck(vm, paramCount, params.c_str()));
+}
+
+namespace detail {
+
+template <typename T>
+inline void* typeTag() {
+  static char tag;
+  return &tag;
+}
+
+// Release hook of bound class instances (see ClassBinder), set once the
+// constructor has run
+template <typename T>
+inline SQInteger releaseBound(SQUserPointer ptr, SQInteger) {
+  reinterpret_cast<T*>(ptr)->~T();
+  return 1;
+}
+
+// The T of instance idx, null unless it's an instance of T's bound class
+// (or a subclass) and T's constructor has run on it
+template <typename T>
+inline T* boundInstance(HSQUIRRELVM v, SQInteger idx) {
+  SQUserPointer p;
+  if (!SQ_SUCCEEDED(sq_getinstanceup(v, idx, &p, typeTag<T>())) ||
+      (sq_getreleasehook(v, idx) != &releaseBound<T>))
+    return nullptr;
+  return reinterpret_cast<T*>(p);
+}
+
+template <int ... I>
+struct Indices {};
+
+template <int N, int ... I>
+struct BuildIndices: BuildIndices<N - 1, N - 1, I ...> {};
+
+template <int ... I>
+struct BuildIndices<0, I ...> {
+  typedef Indices<I ...> Type;
+};
+
+// Argument extraction straight from the stack, types are already validated
+// by the typemask so results of sq_get* are not checked
+template <typename T, typename Enable = void>
+struct Arg;
+
+template <typename T>
+struct Arg<T, typename std::enable_if<std::is_integral<T>::value &&
+                                      !std::is_same<T, bool>::value>::type> {
+  static constexpr SQChar mask = 'i';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_INTEGER; }
+  static T get(HSQUIRRELVM v, SQInteger idx) {
+    SQInteger result;
+    sq_getinteger(v, idx, &result);
+    return static_cast<T>(result);
+  }
+};
+
+template <typename T>
+struct Arg<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static constexpr SQChar mask = 'n';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) & SQOBJECT_NUMERIC; }
+  static T get(HSQUIRRELVM v, SQInteger idx) {
+    SQFloat result;
+    sq_getfloat(v, idx, &result);
+    return static_cast<T>(result);
+  }
+};
+
+template <>
+struct Arg<bool> {
+  static constexpr SQChar mask = 'b';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_BOOL; }
+  static bool get(HSQUIRRELVM v, SQInteger idx) {
+    SQBool result;
+    sq_getbool(v, idx, &result);
+    return result;
+  }
+};
+
+template <>
+struct Arg<const SQChar*> {
+  static constexpr SQChar mask = 's';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_STRING; }
+  static const SQChar* get(HSQUIRRELVM v, SQInteger idx) {
+    const SQChar* result;
+    sq_getstring(v, idx, &result);
+    return result;
+  }
+};
+
+template <>
+struct Arg<std::string> {
+  static constexpr SQChar mask = 's';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_STRING; }
+  static std::string get(HSQUIRRELVM v, SQInteger idx) {
+    const SQChar* result;
+    SQInteger size;
+    sq_getstringandsize(v, idx, &result, &size);
+    return std::string(result, size);
+  }
+};
+
+template <>
+struct Arg<VM::StringView> {
+  static constexpr SQChar mask = 's';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_STRING; }
+  static VM::StringView get(HSQUIRRELVM v, SQInteger idx) {
+    const SQChar* result;
+    SQInteger size;
+    sq_getstringandsize(v, idx, &result, &size);
+    return VM::StringView(result, size);
+  }
+};
+
+template <>
+struct Arg<VM::Any> {
+  static constexpr SQChar mask = '.';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return true; }
+  static VM::Any get(HSQUIRRELVM v, SQInteger idx) {
+    return VM::Any(VM::inst(v), idx);
+  }
+};
+
+// Valid for the duration of the native call
+template <>
+struct Arg<VM::AnyRef> {
+  static constexpr SQChar mask = '.';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return true; }
+  static VM::AnyRef get(HSQUIRRELVM v, SQInteger idx) {
+    return VM::AnyRef(VM::inst(v), idx);
+  }
+};
+
+// Constructed instances of classes bound with their type tag (see ClassBinder)
+template <typename T>
+struct Arg<T*, typename std::enable_if<std::is_class<T>::value>::type> {
+  typedef typename std::remove_cv<T>::type Bound;
+  static constexpr SQChar mask = 'x';
+  static bool is(HSQUIRRELVM v, SQInteger idx) {
+    return boundInstance<Bound>(v, idx) != nullptr;
+  }
+  static T* get(HSQUIRRELVM v, SQInteger idx) {
+    T* result = boundInstance<Bound>(v, idx);
+    if (!result)
+      throw std::invalid_argument("Expected constructed instance of bound class");
+    return result;
+  }
+};
+
+template <typename T>
+using ArgOf = Arg<typename std::decay<T>::type>;
+
+// Return value push, yields the native closure result count
+template <typename T, typename Enable = void>
+struct Ret;
+
+template <>
+struct Ret<void> {};
+
+template <typename T>
+struct Ret<T, typename std::enable_if<std::is_integral<T>::value &&
+                                      !std::is_same<T, bool>::value>::type> {
+  static SQInteger push(HSQUIRRELVM v, T value) {
+    sq_pushinteger(v, static_cast<SQInteger>(value));
+    return 1;
+  }
+};
+
+template <typename T>
+struct Ret<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static SQInteger push(HSQUIRRELVM v, T value) {
+    sq_pushfloat(v, static_cast<SQFloat>(value));
+    return 1;
+  }
+};
+
+template <>
+struct Ret<bool> {
+  static SQInteger push(HSQUIRRELVM v, bool value) {
+    sq_pushbool(v, value? SQTrue: SQFalse);
+    return 1;
+  }
+};
+
+template <>
+struct Ret<const SQChar*> {
+  static SQInteger push(HSQUIRRELVM v, const SQChar* value) {
+    sq_pushstring(v, value, -1);
+    return 1;
+  }
+};
+
+template <>
+struct Ret<std::string> {
+  static SQInteger push(HSQUIRRELVM v, const std::string& value) {
+    sq_pushstring(v, value.c_str(), value.size());
+    return 1;
+  }
+};
+
+template <>
+struct Ret<VM::StringView> {
+  static SQInteger push(HSQUIRRELVM v, VM::StringView value) {
+    sq_pushstring(v, value.data(), value.size());
+    return 1;
+  }
+};
+
+template <>
+struct Ret<VM::Any> {
+  static SQInteger push(HSQUIRRELVM v, const VM::Any& value) {
+    sq_pushobject(v, value.obj);
+    return 1;
+  }
+};
+
+template <>
+struct Ret<VM::AnyRef> {
+  static SQInteger push(HSQUIRRELVM v, const VM::AnyRef& value) {
+    sq_pushobject(v, value.obj);
+    return 1;
+  }
+};
+
+template <typename T>
+using RetOf = Ret<typename std::decay<T>::type>;
+
+// Containers. Elements are not covered by the typemask, they are checked
+// while converting and a mismatch throws std::invalid_argument.
+
+inline SQInteger absIndex(HSQUIRRELVM v, SQInteger idx) {
+  return (idx < 0)? sq_gettop(v) + idx + 1: idx;
+}
+
+// Pops the top of the stack on scope exit, also when a conversion throws
+struct PopGuard {
+  HSQUIRRELVM v;
+  ~PopGuard() { sq_pop(v, 1); }
+};
+
+// Takes the value on top of the stack
+template <typename T>
+inline T popElement(HSQUIRRELVM v) {
+  const PopGuard pop = {v};
+  if (!ArgOf<T>::is(v, -1))
+    throw std::invalid_argument("Wrong container element type");
+  return ArgOf<T>::get(v, -1);
+}
+
+template <typename T>
+inline T getElement(HSQUIRRELVM v, SQInteger array, SQInteger i) {
+  sq_pushinteger(v, i);
+  if (!SQ_SUCCEEDED(sq_rawget(v, array)))
+    throw std::invalid_argument("Array is too short");
+  return popElement<T>(v);
+}
+
+// Array on top of the stack, presized to hold i
+template <typename T>
+inline void setElement(HSQUIRRELVM v, SQInteger i, const T& value) {
+  sq_pushinteger(v, i);
+  RetOf<T>::push(v, value);
+  sq_rawset(v, -3);
+}
+
+template <typename T>
+struct Arg<std::vector<T>> {
+  static constexpr SQChar mask = 'a';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_ARRAY; }
+  static std::vector<T> get(HSQUIRRELVM v, SQInteger idx) {
+    idx = absIndex(v, idx);
+    const SQInteger size = sq_getsize(v, idx);
+    std::vector<T> result;
+    result.reserve(size);
+    for (SQInteger i = 0; i < size; ++i)
+      result.push_back(getElement<T>(v, idx, i));
+    return result;
+  }
+};
+
+template <typename T>
+struct Ret<std::vector<T>> {
+  static SQInteger push(HSQUIRRELVM v, const std::vector<T>& value) {
+    const SQInteger size = static_cast<SQInteger>(value.size());
+    sq_newarray(v, size);
+    for (SQInteger i = 0; i < size; ++i)
+      setElement<T>(v, i, value[i]);
+    return 1;
+  }
+};
+
+template <typename M>
+struct TableArg {
+  static constexpr SQChar mask = 't';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_TABLE; }
+  static M get(HSQUIRRELVM v, SQInteger idx) {
+    idx = absIndex(v, idx);
+    const SQInteger top = sq_gettop(v);
+    M result;
+    sq_pushnull(v);
+    try {
+      while (SQ_SUCCEEDED(sq_next(v, idx))) {
+        typename M::mapped_type value = popElement<typename M::mapped_type>(v);
+        result.emplace(popElement<typename M::key_type>(v), std::move(value));
+      }
+    } catch (...) {
+      sq_settop(v, top);
+      throw;
+    }
+    sq_pop(v, 1);
+    return result;
+  }
+};
+
+template <typename M>
+struct TableRet {
+  static SQInteger push(HSQUIRRELVM v, const M& value) {
+    sq_newtableex(v, static_cast<SQInteger>(value.size()));
+    for (auto& item: value) {
+      RetOf<typename M::key_type>::push(v, item.first);
+      RetOf<typename M::mapped_type>::push(v, item.second);
+      sq_rawset(v, -3);
+    }
+    return 1;
+  }
+};
+
+template <typename K, typename V>
+struct Arg<std::map<K, V>>: TableArg<std::map<K, V>> {};
+
+template <typename K, typename V>
+struct Ret<std::map<K, V>>: TableRet<std::map<K, V>> {};
+
+template <typename K, typename V>
+struct Arg<std::unordered_map<K, V>>: TableArg<std::unordered_map<K, V>> {};
+
+template <typename K, typename V>
+struct Ret<std::unordered_map<K, V>>: TableRet<std::unordered_map<K, V>> {};
+
+// Tuples are fixed size arrays
+template <typename ... Ts>
+struct Arg<std::tuple<Ts ...>> {
+  typedef typename BuildIndices<sizeof...(Ts)>::Type Index;
+
+  static constexpr SQChar mask = 'a';
+  static bool is(HSQUIRRELVM v, SQInteger idx) { return sq_gettype(v, idx) == OT_ARRAY; }
+  static std::tuple<Ts ...> get(HSQUIRRELVM v, SQInteger idx) {
+    idx = absIndex(v, idx);
+    if (sq_getsize(v, idx) != sizeof...(Ts))
+      throw std::invalid_argument("Wrong tuple size");
+    return get(v, idx, Index());
+  }
+
+  template <int ... I>
+  static std::tuple<Ts ...> get(HSQUIRRELVM v, SQInteger idx, Indices<I ...>) {
+    return std::tuple<Ts ...>{getElement<Ts>(v, idx, I) ...};
+  }
+};
+
+template <typename ... Ts>
+struct Ret<std::tuple<Ts ...>> {
+  typedef typename BuildIndices<sizeof...(Ts)>::Type Index;
+
+  static SQInteger push(HSQUIRRELVM v, const std::tuple<Ts ...>& value) {
+    sq_newarray(v, sizeof...(Ts));
+    push(v, value, Index());
+    return 1;
+  }
+
+  template <int ... I>
+  static void push(HSQUIRRELVM v, const std::tuple<Ts ...>& value, Indices<I ...>) {
+    const int expand[] = {0, (setElement<Ts>(v, I, std::get<I>(value)), 0) ...};
+    (void)expand;
+  }
+};
+
+// Calls f with arguments taken from stack slots 2..N+1 (1 is "this")
+template <typename R, typename ... Args>
+struct Invoker {
+  template <typename F, int ... I>
+  static SQInteger call(HSQUIRRELVM v, F& f, Indices<I ...>) {
+    return RetOf<R>::push(v, f(ArgOf<Args>::get(v, I + 2) ...));
+  }
+};
+
+template <typename ... Args>
+struct Invoker<void, Args ...> {
+  template <typename F, int ... I>
+  static SQInteger call(HSQUIRRELVM v, F& f, Indices<I ...>) {
+    f(ArgOf<Args>::get(v, I + 2) ...);
+    return 0;
+  }
+};
+
+template <typename R, typename ... Args>
+struct Signature {
+  typedef Invoker<R, Args ...> Invoke;
+  typedef typename BuildIndices<sizeof...(Args)>::Type Index;
+  static constexpr SQInteger paramCount = sizeof...(Args) + 1;
+
+  template <SQChar self>
+  static const SQChar* typeMask() {
+    static const SQChar mask[] = {self, ArgOf<Args>::mask ..., '\0'};
+    return mask;
+  }
+};
+
+template <typename F>
+struct FunctionTraits: FunctionTraits<decltype(&F::operator())> {};
+
+template <typename R, typename ... Args>
+struct FunctionTraits<R (*)(Args ...)>: Signature<R, Args ...> {};
+
+template <typename R, typename ... Args>
+struct FunctionTraits<R (Args ...)>: Signature<R, Args ...> {};
+
+template <typename C, typename R, typename ... Args>
+struct FunctionTraits<R (C::*)(Args ...)>: Signature<R, Args ...> {};
+
+template <typename C, typename R, typename ... Args>
+struct FunctionTraits<R (C::*)(Args ...) const>: Signature<R, Args ...> {};
+
+template <typename C, typename M, typename R, typename ... Args>
+struct BoundMethod {
+  C* object;
+  M method;
+  R operator () (Args ... args) const {
+    return (object->*method)(std::forward<Args>(args) ...);
+  }
+};
+
+}
+
+template <typename F>
+inline void VM::pushFunction(F func) {
+  typedef detail::FunctionTraits<typename std::decay<F>::type> Traits;
+  struct Impl {
+    static SQInteger call(HSQUIRRELVM v) {
+      try {
+        SQVM_NATIVE_METRIC(v);
+        SQUserPointer f;
+        sq_getuserdata(v, -1, &f, nullptr);
+        SQVM_NATIVE_RETURN(Traits::Invoke::call(v, *reinterpret_cast<F*>(f), typename Traits::Index()));
+      } catch (std::exception& e) {
+        return sq_throwerror(v, e.what());
+      }
+    }
+  };
   SQVM_TOPG;
-  SQVM_ASS(sq_compilebuffer(vm, code.c_str(), code.size(), fileName.c_str(), SQTrue));
+  pushUserValue<F>(func);
+  pushRawClosure(&Impl::call, 1);
+  setParameterCheck(Traits::paramCount, Traits::template typeMask<'.'>());
+  g.check(1);
+}
+
+template <typename F, F func>
+inline void VM::pushFunction() {
+  typedef detail::FunctionTraits<F> Traits;
+  struct Impl {
+    static SQInteger call(HSQUIRRELVM v) {
+      try {
+        SQVM_NATIVE_METRIC(v);
+        SQVM_NATIVE_RETURN(Traits::Invoke::call(v, *func, typename Traits::Index()));
+      } catch (std::exception& e) {
+        return sq_throwerror(v, e.what());
+      }
+    }
+  };
+  SQVM_TOPG;
+  pushRawClosure(&Impl::call);
+  setParameterCheck(Traits::paramCount, Traits::template typeMask<'.'>());
+  g.check(1);
+}
+
+template <typename C, typename R, typename ... Args>
+inline void VM::pushMethod(R (C::*method)(Args ...)) {
+  typedef R (C::*M)(Args ...);
+  typedef detail::Signature<R, Args ...> Traits;
+  struct Impl {
+    static SQInteger call(HSQUIRRELVM v) {
+      try {
+        SQVM_NATIVE_METRIC(v);
+        C* self = detail::boundInstance<C>(v, 1);
+        if (!self)
+          return sq_throwerror(v, "Method called on instance of wrong class or before its constructor");
+        SQUserPointer m;
+        sq_getuserdata(v, -1, &m, nullptr);
+        detail::BoundMethod<C, M, R, Args ...> bound = {self, *reinterpret_cast<M*>(m)};
+        SQVM_NATIVE_RETURN(Traits::Invoke::call(v, bound, typename Traits::Index()));
+      } catch (std::exception& e) {
+        return sq_throwerror(v, e.what());
+      }
+    }
+  };
+  SQVM_TOPG;
+  pushUserValue<M>(method);
+  pushRawClosure(&Impl::call, 1);
+  setParameterCheck(Traits::paramCount, Traits::template typeMask<'x'>());
+  g.check(1);
+}
+
+template <typename C, typename R, typename ... Args>
+inline void VM::pushMethod(R (C::*method)(Args ...) const) {
+  typedef R (C::*M)(Args ...) const;
+  typedef detail::Signature<R, Args ...> Traits;
+  struct Impl {
+    static SQInteger call(HSQUIRRELVM v) {
+      try {
+        SQVM_NATIVE_METRIC(v);
+        C* self = detail::boundInstance<C>(v, 1);
+        if (!self)
+          return sq_throwerror(v, "Method called on instance of wrong class or before its constructor");
+        SQUserPointer m;
+        sq_getuserdata(v, -1, &m, nullptr);
+        detail::BoundMethod<const C, M, R, Args ...> bound = {self, *reinterpret_cast<M*>(m)};
+        SQVM_NATIVE_RETURN(Traits::Invoke::call(v, bound, typename Traits::Index()));
+      } catch (std::exception& e) {
+        return sq_throwerror(v, e.what());
+      }
+    }
+  };
+  SQVM_TOPG;
+  pushUserValue<M>(method);
+  pushRawClosure(&Impl::call, 1);
+  setParameterCheck(Traits::paramCount, Traits::template typeMask<'x'>());
   g.check(1);
 }
 
 inline void VM::exec(const std::string& code, const std::string& fileName) {
+  SQVM_METRIC(EXEC);
   const int top = getTop();
   compile(code, fileName);
   pushRootTable();
   call(1, false);
   setTop(top);
-}
-
-inline void VM::doFile(const std::string& fileName) {
-  const int top = getTop();
-  pushRootTable();
-  SQVM_ASS(sqstd_dofile(vm, fileName.c_str(), SQFalse, SQTrue));
-  setTop(top);
+  SQVM_METRIC_OK;
 }
 
 // Data types:
@@ -723,13 +1742,12 @@ inline void VM::doFile(const std::string& fileName) {
 inline SQInteger VM::getInt(SQInteger idx) const {
   SQInteger v;
   if (!SQ_SUCCEEDED(sq_getinteger(vm, idx, &v)))
-    throw Error(this, idx, (boost::format("Expected integer but got value of type %1%")
-                % valueTypeName(idx)).str());
+    throw Error(this, idx, Error::Static("Expected integer"), valueTypeName(idx));
   return v;
 }
 
 template <typename Key>
-inline SQInteger VM::getIntField(Key key, SQInteger idx) const {
+inline SQInteger VM::getIntField(const Key& key, SQInteger idx) const {
   SQVM_CTOPG;
   const_cast<VM*>(this)->pushField(key, idx);
   SQInteger value;
@@ -742,6 +1760,7 @@ inline VM& VM::operator >> (SQInteger& data) {
   data = getInt();
   pop();
   g.check(-1);
+  return *this;
 }
 
 inline VM& VM::operator << (SQInteger data) {
@@ -749,7 +1768,7 @@ inline VM& VM::operator << (SQInteger data) {
   return *this;
 }
 
-inline SQInteger VM::Any::getInt() const {
+inline SQInteger VM::AnyRef::getInt() const {
   return sq_objtointeger(&obj);
 }
 
@@ -758,13 +1777,12 @@ inline SQInteger VM::Any::getInt() const {
 inline SQFloat VM::getFloat(SQInteger idx) const {
   SQFloat v;
   if (!SQ_SUCCEEDED(sq_getfloat(vm, idx, &v)))
-    throw Error(this, idx, (boost::format("Expected float but got value of type %1%")
-                % valueTypeName(idx)).str());
+    throw Error(this, idx, Error::Static("Expected float"), valueTypeName(idx));
   return v;
 }
 
 template <typename Key>
-inline SQFloat VM::getFloatField(Key key, SQInteger idx) const {
+inline SQFloat VM::getFloatField(const Key& key, SQInteger idx) const {
   SQVM_CTOPG;
   const_cast<VM*>(this)->pushField(key, idx);
   SQFloat value;
@@ -777,6 +1795,7 @@ inline VM& VM::operator >> (SQFloat& data) {
   data = getFloat();
   pop();
   g.check(-1);
+  return *this;
 }
 
 inline VM& VM::operator << (SQFloat data) {
@@ -784,32 +1803,35 @@ inline VM& VM::operator << (SQFloat data) {
   return *this;
 }
 
-inline SQFloat VM::Any::getFloat() const {
+inline SQFloat VM::AnyRef::getFloat() const {
   return sq_objtofloat(&obj);
 }
 
 // string
 
 inline std::string VM::getString(SQInteger idx) const {
+  return getStringView(idx).str();
+}
+
+inline VM::StringView VM::getStringView(SQInteger idx) const {
   const SQChar* str;
-  if (!SQ_SUCCEEDED(sq_getstring(vm, idx, &str)))
-    throw Error(this, idx, (boost::format("Expected string but got value of type %1%")
-                % valueTypeName(idx)).str());
-  return std::string(str);
+  SQInteger size;
+  if (!SQ_SUCCEEDED(sq_getstringandsize(vm, idx, &str, &size)))
+    throw Error(this, idx, Error::Static("Expected string"), valueTypeName(idx));
+  return StringView(str, size);
 }
 
 inline std::string VM::getAsString(SQInteger idx) const {
   SQVM_CTOPG;
   if (!SQ_SUCCEEDED(sq_tostring(vm, idx)))
-    throw Error(this, idx, (boost::format("Can't convert value of type %1% to string")
-                % valueTypeName(idx)).str());
+    throw Error(this, idx, Error::Static("Can't convert to string"), valueTypeName(idx));
   std::string result;
   const_cast<VM&>(*this) >> result;
   return result;
 }
 
 template <typename Key>
-inline std::string VM::getStringField(Key key, SQInteger idx) const {
+inline std::string VM::getStringField(const Key& key, SQInteger idx) const {
   SQVM_CTOPG;
   const_cast<VM*>(this)->pushField(key, idx);
   std::string value;
@@ -822,6 +1844,7 @@ inline VM& VM::operator >> (std::string& data) {
   data = getString();
   pop();
   g.check(-1);
+  return *this;
 }
 
 inline VM& VM::operator << (const std::string& data) {
@@ -829,8 +1852,32 @@ inline VM& VM::operator << (const std::string& data) {
   return *this;
 }
 
-inline std::string VM::Any::getString() const {
-  return std::string(sq_objtostring(&obj));
+inline VM& VM::operator << (const SQChar* data) {
+  SQVM_TOPG; sq_pushstring(vm, data, -1); g.check(1);
+  return *this;
+}
+
+inline VM& VM::operator << (StringView data) {
+  SQVM_TOPG; sq_pushstring(vm, data.data(), data.size()); g.check(1);
+  return *this;
+}
+
+inline std::string VM::AnyRef::getString() const {
+  return getStringView().str();
+}
+
+// There's no length-aware sq_objtostring, so the object is pushed briefly;
+// the view stays valid while the string is held
+inline VM::StringView VM::AnyRef::getStringView() const {
+  if (obj._type != OT_STRING)
+    throw Error(vm, 0, Error::Static("Expected string"), VM::typeName(obj._type));
+  if (!vm) return StringView(sq_objtostring(&obj));
+  const SQChar* str;
+  SQInteger size;
+  sq_pushobject(vm->vm, obj);
+  sq_getstringandsize(vm->vm, -1, &str, &size);
+  sq_pop(vm->vm, 1);
+  return StringView(str, size);
 }
 
 // bool
@@ -838,8 +1885,7 @@ inline std::string VM::Any::getString() const {
 inline bool VM::getBool(SQInteger idx) const {
   SQBool v;
   if (!SQ_SUCCEEDED(sq_getbool(vm, idx, &v)))
-    throw Error(this, idx, (boost::format("Expected bool but got value of type %1%")
-                % valueTypeName(idx)).str());
+    throw Error(this, idx, Error::Static("Expected bool"), valueTypeName(idx));
   return v;
 }
 
@@ -850,7 +1896,7 @@ inline bool VM::getAsBool(SQInteger idx) const {
 }
 
 template <typename Key>
-inline bool VM::getBoolField(Key key, SQInteger idx) const {
+inline bool VM::getBoolField(const Key& key, SQInteger idx) const {
   SQVM_CTOPG;
   const_cast<VM*>(this)->pushField(key, idx);
   bool value;
@@ -863,6 +1909,7 @@ inline VM& VM::operator >> (bool& data) {
   data = getBool();
   pop();
   g.check(-1);
+  return *this;
 }
 
 inline VM& VM::operator << (bool data) {
@@ -870,7 +1917,7 @@ inline VM& VM::operator << (bool data) {
   return *this;
 }
 
-inline bool VM::Any::getBool() const {
+inline bool VM::AnyRef::getBool() const {
   return sq_objtobool(&obj);
 }
 
@@ -881,7 +1928,7 @@ inline VM::Any VM::get(SQInteger idx) const {
 }
 
 template <typename Key>
-inline VM::Any VM::getField(Key key, SQInteger idx) const {
+inline VM::Any VM::getField(const Key& key, SQInteger idx) const {
   SQVM_CTOPG;
   const_cast<VM*>(this)->pushField(key, idx);
   VM::Any value;
@@ -894,6 +1941,7 @@ inline VM& VM::operator >> (Any& data) {
   data.reset(this);
   pop();
   g.check(-1);
+  return *this;
 }
 
 inline VM& VM::operator << (const Any& data) {
@@ -901,10 +1949,112 @@ inline VM& VM::operator << (const Any& data) {
   return *this;
 }
 
+inline VM& VM::operator << (const AnyRef& data) {
+  SQVM_TOPG; sq_pushobject(vm, data.obj); g.check(1);
+  return *this;
+}
+
+namespace detail {
+
+inline bool isNumber(const HSQOBJECT& obj) {
+  return (obj._type == OT_INTEGER) || (obj._type == OT_FLOAT);
+}
+
+template <typename T, typename Enable = void>
+struct ObjectConv;
+
+template <typename T>
+struct ObjectConv<T, typename std::enable_if<std::is_integral<T>::value &&
+                                             !std::is_same<T, bool>::value>::type> {
+  static constexpr const char* expected = "Expected integer";
+  static bool is(const VM::AnyRef& ref) { return isNumber(ref.obj); }
+  static T get(const VM::AnyRef& ref) { return static_cast<T>(ref.getInt()); }
+};
+
+template <typename T>
+struct ObjectConv<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static constexpr const char* expected = "Expected float";
+  static bool is(const VM::AnyRef& ref) { return isNumber(ref.obj); }
+  static T get(const VM::AnyRef& ref) { return static_cast<T>(ref.getFloat()); }
+};
+
+template <>
+struct ObjectConv<bool> {
+  static constexpr const char* expected = "Expected bool";
+  static bool is(const VM::AnyRef& ref) { return ref.obj._type == OT_BOOL; }
+  static bool get(const VM::AnyRef& ref) { return ref.getBool(); }
+};
+
+template <>
+struct ObjectConv<std::string> {
+  static constexpr const char* expected = "Expected string";
+  static bool is(const VM::AnyRef& ref) { return ref.obj._type == OT_STRING; }
+  static std::string get(const VM::AnyRef& ref) { return ref.getString(); }
+};
+
+template <>
+struct ObjectConv<VM::StringView> {
+  static constexpr const char* expected = "Expected string";
+  static bool is(const VM::AnyRef& ref) { return ref.obj._type == OT_STRING; }
+  static VM::StringView get(const VM::AnyRef& ref) { return ref.getStringView(); }
+};
+
+}
+
+template <typename T>
+inline T VM::AnyRef::get() const {
+  typedef detail::ObjectConv<typename std::decay<T>::type> Conv;
+  if (!Conv::is(*this))
+    throw Error(vm, 0, Error::Static(Conv::expected), VM::typeName(obj._type));
+  return Conv::get(*this);
+}
+
+// containers
+
+template <typename T>
+inline void VM::push(const std::vector<T>& data) {
+  SQVM_TOPG; detail::Ret<std::vector<T>>::push(vm, data); g.check(1);
+}
+
+template <typename K, typename V>
+inline void VM::push(const std::map<K, V>& data) {
+  SQVM_TOPG; detail::Ret<std::map<K, V>>::push(vm, data); g.check(1);
+}
+
+template <typename K, typename V>
+inline void VM::push(const std::unordered_map<K, V>& data) {
+  SQVM_TOPG; detail::Ret<std::unordered_map<K, V>>::push(vm, data); g.check(1);
+}
+
+template <typename ... Ts>
+inline void VM::push(const std::tuple<Ts ...>& data) {
+  SQVM_TOPG; detail::Ret<std::tuple<Ts ...>>::push(vm, data); g.check(1);
+}
+
+template <typename T>
+inline T VM::get(SQInteger idx) const {
+  SQVM_CTOPG;
+  typedef detail::ArgOf<T> Conv;
+  if (!Conv::is(vm, idx))
+    throw Error(this, idx, Error::Static("Wrong type for conversion"), valueTypeName(idx));
+  try {
+    return Conv::get(vm, idx);
+  } catch (std::invalid_argument& e) {
+    throw Error(this, idx, std::string(e.what()));
+  }
+}
+
 }
 
+#undef SQVM_ALLOC
+#undef SQVM_REF_ALLOC
 #undef SQVM_TOPG
 #undef SQVM_LTOPG
 #undef SQVM_CTOPG
 #undef SQVM_ASS
+#undef SQVM_METRIC
+#undef SQVM_NATIVE_METRIC
+#undef SQVM_METRIC_OK
+#undef SQVM_NATIVE_RETURN
+#undef SQVM_COUNT_ERROR
 
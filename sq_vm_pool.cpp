@@ -0,0 +1,52 @@
+#include "sq_vm_pool.h"
+
+namespace sq {
+
+VMPool::VMPool(size_t size, Initializer init, VM::PrintHandler* handler)
+    : init(init), handler(handler) {
+  idle.reserve(size);
+  for (size_t i = 0; i < size; ++i)
+    idle.push_back(create());
+}
+
+VMPool::Lease VMPool::acquire() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!idle.empty()) {
+      std::unique_ptr<VM> vm = std::move(idle.back());
+      idle.pop_back();
+      return Lease(this, std::move(vm));
+    }
+  }
+  return Lease(this, create());
+}
+
+size_t VMPool::idleCount() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return idle.size();
+}
+
+std::unique_ptr<VM> VMPool::create() {
+  std::unique_ptr<VM> vm(new VM(handler));
+  if (init) init(*vm);
+  vm->markPristine();
+  return vm;
+}
+
+void VMPool::release(std::unique_ptr<VM> vm) {
+  vm->printHandler = handler;
+  vm->resetToPristine();
+  std::lock_guard<std::mutex> lock(mutex);
+  idle.push_back(std::move(vm));
+}
+
+VMPool::Lease::~Lease() {
+  if (!vm) return;
+  try {
+    pool->release(std::move(vm));
+  } catch (std::exception&) {
+    // A VM that can't be reset is dropped
+  }
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "sq_vm.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sq {
+
+// Pool of pre-warmed VMs. Each VM is booted and initialized once, then
+// snapshotted with markPristine(); leases hand VMs out and reset them to
+// the pristine state on return, so request startup skips sq_open and the
+// stdlib registration. A VM that can't be reset (see resetToPristine) is
+// dropped and replaced by a new one on demand.
+class VMPool {
+public:
+  class Lease;
+  typedef std::function<void(VM&)> Initializer;
+
+  explicit VMPool(size_t size, Initializer init = Initializer(),
+                  VM::PrintHandler* handler = nullptr);
+  VMPool(const VMPool&) = delete;
+
+  // Creates a new VM if none is idle
+  Lease acquire();
+  size_t idleCount() const;
+
+private:
+  std::unique_ptr<VM> create();
+  void release(std::unique_ptr<VM> vm);
+
+  Initializer init;
+  VM::PrintHandler* handler;
+  mutable std::mutex mutex;
+  std::vector<std::unique_ptr<VM>> idle;
+};
+
+class VMPool::Lease {
+public:
+  Lease(Lease&& other) noexcept: pool(other.pool), vm(std::move(other.vm)) {}
+  Lease(const Lease&) = delete;
+  ~Lease();
+
+  inline VM* get() const { return vm.get(); }
+  inline VM* operator -> () const { return vm.get(); }
+  inline VM& operator * () const { return *vm; }
+
+private:
+  friend class VMPool;
+  Lease(VMPool* pool, std::unique_ptr<VM> vm): pool(pool), vm(std::move(vm)) {}
+
+  VMPool* pool;
+  std::unique_ptr<VM> vm;
+};
+
+}
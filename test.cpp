@@ -1,12 +1,24 @@
+#include "sq_socket_console.h"
 #include "sq_text_console.h"
 
 sq::VM& operator << (sq::VM& vm, int data) {
-  vm << SQInteger(data);
+  return vm << SQInteger(data);
 }
 
-int main() {
+// test [--batch [file] | --listen <socket>]
+int main(int argc, char** argv) {
   sq::TextConsole console;
   sq::VM vm(&console);
   console.vm = &vm;
+  if ((argc > 1) && (std::string(argv[1]) == "--batch"))
+    return ((argc > 2)? console.batch(argv[2]): console.batch())? 0: 1;
+  if ((argc > 2) && (std::string(argv[1]) == "--listen")) {
+    sq::SocketConsole::Options options;
+    options.vm = &vm;
+    sq::SocketConsole server(options);
+    server.listenUnix(argv[2]);
+    server.run();
+    return 0;
+  }
   console.repl();
 }